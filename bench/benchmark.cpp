@@ -0,0 +1,146 @@
+#include "circular_buffer.h"
+#include "nor_flash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define FLASH_SIZE (128 * 4096)
+#define SECTOR_SIZE 4096
+// operations timed per workload, fewer when the buffer holds less records
+#define OPS 2000
+#define BATCH 32
+
+struct bench_config {
+    const char* name;
+    cb_config config;
+};
+
+// records moved by a workload and the latency of each of its calls in microseconds, a batch call moves BATCH records
+struct bench_run {
+    std::vector<double> latency;
+    size_t records = 0;
+};
+
+static double host_us() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Times one call as the host time it took plus the time the flash was busy during it
+ */
+template <typename F> static esp_err_t timed(nor_flash* flash, bench_run* run, F call) {
+    double busy = flash->stats.busy_us;
+    double start = host_us();
+    esp_err_t err = call();
+    run->latency.push_back(host_us() - start + flash->stats.busy_us - busy);
+    return err;
+}
+
+static void fill(uint8_t* record, size_t record_size, uint32_t index) {
+    for (size_t i = 0; i < record_size; i++) { record[i] = (uint8_t)(index + i); }
+}
+
+static esp_err_t prefill(CircularBuffer* cb, std::vector<uint8_t>& records, size_t count) {
+    for (size_t done = 0; done < count; done += BATCH) {
+        size_t n = count - done < BATCH ? count - done : BATCH;
+        esp_err_t err = cb->push_back_n(records.data(), n);
+        if (err != ESP_OK) { return err; }
+    }
+    return cb->flush();
+}
+
+static void report(const char* config, const char* workload, size_t record_size, bench_run* run, const nor_stats& stats) {
+    if (run->latency.empty() || run->records == 0) {
+        printf("%-8s %-10s %6zu   no records\n", config, workload, record_size);
+        return;
+    }
+    std::vector<double>& latency = run->latency;
+    double total = 0;
+    for (double us : latency) { total += us; }
+    std::sort(latency.begin(), latency.end());
+    double p50 = latency[latency.size() / 2];
+    double p99 = latency[latency.size() * 99 / 100];
+    printf("%-8s %-10s %6zu %12.0f %10.1f %10.1f %12.1f %10.4f\n", config, workload, record_size,
+        run->records / (total / 1e6), p50, p99, (double)stats.program_bytes / run->records, (double)stats.erases / run->records);
+}
+
+/**
+ * Runs the push, pop, overwrite and batch workloads on a freshly erased flash each
+ */
+static void bench(nor_flash* flash, const bench_config& bc, size_t record_size) {
+    cb_storage storage;
+    nor_flash_storage(flash, &storage);
+    std::vector<uint8_t> record(record_size);
+    std::vector<uint8_t> records(record_size * BATCH);
+    for (size_t i = 0; i < BATCH; i++) { fill(records.data() + i * record_size, record_size, i); }
+    const char* workloads[] = { "push", "pop", "overwrite", "batch" };
+    for (int w = 0; w < 4; w++) {
+        nor_flash_wipe(flash);
+        cb_config config = bc.config;
+        config.overwrite = w == 2;
+        CircularBuffer cb;
+        if (cb.init(storage, record_size, config) != ESP_OK) {
+            printf("%-8s %-10s %6zu   init failed\n", bc.name, workloads[w], record_size);
+            return;
+        }
+        size_t count = cb.get_max_records() < OPS ? cb.get_max_records() : OPS;
+        if (w == 1 && prefill(&cb, records, count) != ESP_OK) { return; }
+        // the overwrite workload starts from a full buffer so every push drops the front
+        if (w == 2 && prefill(&cb, records, cb.get_max_records()) != ESP_OK) { return; }
+        flash->stats = nor_stats();
+        bench_run run;
+        esp_err_t err = ESP_OK;
+        for (uint32_t i = 0; err == ESP_OK && run.records < (w == 2 ? OPS : count); i++) {
+            if (w == 0 || w == 2) {
+                fill(record.data(), record_size, i);
+                err = timed(flash, &run, [&]() { return cb.push_back(record.data()); });
+                run.records++;
+            } else if (w == 1) {
+                err = timed(flash, &run, [&]() { return cb.pop_front(record.data()); });
+                run.records++;
+            } else {
+                size_t n = count - run.records < BATCH ? count - run.records : BATCH;
+                err = timed(flash, &run, [&]() { return cb.push_back_n(records.data(), n); });
+                run.records += n;
+            }
+        }
+        // records pushed with a back cache count once they are written
+        if (err == ESP_OK) { err = cb.flush(); }
+        if (err != ESP_OK) {
+            printf("%-8s %-10s %6zu   failed with 0x%x\n", bc.name, workloads[w], record_size, (unsigned)err);
+            continue;
+        }
+        report(bc.name, workloads[w], record_size, &run, flash->stats);
+    }
+}
+
+int main() {
+    nor_flash flash;
+    if (nor_flash_init(&flash, FLASH_SIZE, SECTOR_SIZE) != ESP_OK) { return 1; }
+    bench_config configs[4];
+    configs[0].name = "plain";
+    configs[1].name = "journal";
+    configs[1].config.journal = true;
+    configs[2].name = "cache";
+    configs[2].config.journal = true;
+    configs[2].config.cache_back = true;
+    configs[2].config.cache_front = true;
+    configs[2].config.flush_records = 16;
+    configs[3].name = "crc";
+    configs[3].config.journal = true;
+    configs[3].config.record_crc = true;
+    configs[3].config.checkpoint_records = 64;
+
+    printf("page program %.1f + %.1f us/byte, sector erase %.0f us, read %.1f + %.3f us/byte\n", flash.timing.program_first_us,
+        flash.timing.program_byte_us, flash.timing.sector_erase_us, flash.timing.read_setup_us, flash.timing.read_byte_us);
+    printf("%-8s %-10s %6s %12s %10s %10s %12s %10s\n", "config", "workload", "size", "records/s", "p50 us", "p99 us", "bytes/rec", "erases/rec");
+    size_t sizes[] = { 16, 64, 256, 1024 };
+    for (const bench_config& bc : configs) {
+        for (size_t record_size : sizes) { bench(&flash, bc, record_size); }
+    }
+    nor_flash_deinit(&flash);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "nor_flash.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static esp_err_t nor_read(void* ctx, size_t addr, void* dest, size_t len) {
+    nor_flash* flash = (nor_flash*)ctx;
+    if (addr + len > flash->size) { return ESP_ERR_INVALID_SIZE; }
+    memcpy(dest, flash->image + addr, len);
+    flash->stats.reads++;
+    flash->stats.read_bytes += len;
+    flash->stats.busy_us += flash->timing.read_setup_us + len * flash->timing.read_byte_us;
+    return ESP_OK;
+}
+
+static esp_err_t nor_write(void* ctx, size_t addr, const void* src, size_t len) {
+    nor_flash* flash = (nor_flash*)ctx;
+    if (addr + len > flash->size) { return ESP_ERR_INVALID_SIZE; }
+    const uint8_t* data = (const uint8_t*)src;
+    size_t page = flash->timing.page_size;
+    while (len > 0) {
+        // a program can't cross a page boundary
+        size_t chunk = page - addr % page < len ? page - addr % page : len;
+        uint8_t* dest = flash->image + addr;
+        for (size_t i = 0; i < chunk; i++) { dest[i] &= data[i]; }
+        flash->stats.programs++;
+        flash->stats.program_bytes += chunk;
+        flash->stats.busy_us += flash->timing.program_first_us + (chunk - 1) * flash->timing.program_byte_us;
+        addr += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t nor_erase(void* ctx, size_t addr, size_t len) {
+    nor_flash* flash = (nor_flash*)ctx;
+    if (addr % flash->sector_size != 0 || len % flash->sector_size != 0) { return ESP_ERR_INVALID_ARG; }
+    if (addr + len > flash->size) { return ESP_ERR_INVALID_SIZE; }
+    memset(flash->image + addr, 0xFF, len);
+    flash->stats.erases += len / flash->sector_size;
+    flash->stats.busy_us += len / flash->sector_size * flash->timing.sector_erase_us;
+    return ESP_OK;
+}
+
+/**
+ * Allocates an erased flash
+ * @param size size in bytes, a multiple of sector_size
+ * @param sector_size erase unit
+ * @param timing cost of every operation
+ * @return ESP_OK if ok
+ */
+esp_err_t nor_flash_init(nor_flash* flash, size_t size, size_t sector_size, const nor_timing& timing) {
+    if (sector_size == 0 || size == 0 || size % sector_size != 0) { return ESP_ERR_INVALID_SIZE; }
+    flash->image = (uint8_t*)malloc(size);
+    if (flash->image == NULL) { return ESP_ERR_NO_MEM; }
+    flash->size = size;
+    flash->sector_size = sector_size;
+    flash->timing = timing;
+    nor_flash_wipe(flash);
+    return ESP_OK;
+}
+
+void nor_flash_deinit(nor_flash* flash) {
+    free(flash->image);
+    flash->image = NULL;
+}
+
+/**
+ * Erases the whole flash without accounting for it and resets the counters
+ */
+void nor_flash_wipe(nor_flash* flash) {
+    memset(flash->image, 0xFF, flash->size);
+    flash->stats = nor_stats();
+}
+
+/**
+ * Sets up a storage on the flash, which is not mapped so every read is accounted
+ */
+void nor_flash_storage(nor_flash* flash, cb_storage* storage) {
+    storage->read = nor_read;
+    storage->write = nor_write;
+    storage->erase = nor_erase;
+    storage->ctx = flash;
+    storage->size = flash->size;
+    storage->sector_size = flash->sector_size;
+    storage->mapped = NULL;
+    storage->release = NULL;
+    storage->load_header = NULL;
+    storage->store_header = NULL;
+}
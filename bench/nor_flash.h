@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cb_storage.h"
+
+// typical timings of a SPI NOR flash like the W25Q series in microseconds
+struct nor_timing {
+    // writes are split into programs of at most one page
+    size_t page_size = 256;
+    // programming the first byte of a page and every further one
+    double program_first_us = 30;
+    double program_byte_us = 2.5;
+    double sector_erase_us = 45000;
+    // command and address phase of a read, then the transfer at 40 MB/s
+    double read_setup_us = 1;
+    double read_byte_us = 0.025;
+};
+
+// work done by the flash since it was created or its counters were reset
+struct nor_stats {
+    uint64_t reads = 0;
+    uint64_t read_bytes = 0;
+    uint64_t programs = 0;
+    uint64_t program_bytes = 0;
+    uint64_t erases = 0;
+    // time the flash was busy according to its timing
+    double busy_us = 0;
+};
+
+/**
+ * NOR flash kept in RAM that counts its operations and adds up how long real flash would take for them
+ * The time is only accounted, calls return at once
+ */
+struct nor_flash {
+    uint8_t* image = NULL;
+    size_t size = 0;
+    size_t sector_size = 0;
+    nor_timing timing;
+    nor_stats stats;
+};
+
+esp_err_t nor_flash_init(nor_flash* flash, size_t size, size_t sector_size, const nor_timing& timing = nor_timing());
+void nor_flash_deinit(nor_flash* flash);
+void nor_flash_wipe(nor_flash* flash);
+void nor_flash_storage(nor_flash* flash, cb_storage* storage);
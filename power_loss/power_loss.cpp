@@ -0,0 +1,347 @@
+#include "circular_buffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// small enough that the workloads wrap around the data area several times
+#define SECTOR_SIZE 4096
+#define FLASH_SIZE (6 * SECTOR_SIZE)
+#define PAGE_SIZE 256
+#define RECORD_SIZE 500
+#define WORKLOAD_OPS 300
+#define MAX_BATCH 6
+#define PRINTED_FAILURES 10
+
+// a write or erase reaching the flash, recorded while running a workload without power cuts
+struct flash_op {
+    bool erase;
+    size_t addr;
+    size_t len;
+};
+
+/**
+ * NOR flash in RAM that loses power in the middle of one of its operations
+ * The interrupted write programs only its first torn bytes, an interrupted erase with torn set clears only the first
+ * half of the range; the operation and every one after it fail
+ */
+struct fault_flash {
+    uint8_t image[FLASH_SIZE];
+    // operations done since power up, index of the interrupted one or SIZE_MAX
+    size_t ops;
+    size_t cut_at;
+    size_t torn;
+    bool dead;
+    std::vector<flash_op>* trace;
+};
+
+static fault_flash flash;
+
+static esp_err_t fault_read(void*, size_t addr, void* dest, size_t len) {
+    if (flash.dead) { return ESP_FAIL; }
+    memcpy(dest, flash.image + addr, len);
+    return ESP_OK;
+}
+
+static esp_err_t fault_write(void*, size_t addr, const void* src, size_t len) {
+    if (flash.dead) { return ESP_FAIL; }
+    if (flash.trace != NULL) { flash.trace->push_back({ false, addr, len }); }
+    bool cut = flash.ops++ == flash.cut_at;
+    size_t done = cut ? flash.torn : len;
+    const uint8_t* data = (const uint8_t*)src;
+    for (size_t i = 0; i < done; i++) { flash.image[addr + i] &= data[i]; }
+    if (cut) { flash.dead = true; }
+    return cut ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t fault_erase(void*, size_t addr, size_t len) {
+    if (flash.dead) { return ESP_FAIL; }
+    if (flash.trace != NULL) { flash.trace->push_back({ true, addr, len }); }
+    bool cut = flash.ops++ == flash.cut_at;
+    if (!cut) { memset(flash.image + addr, 0xFF, len); }
+    else if (flash.torn != 0) { memset(flash.image + addr, 0xFF, len / 2); }
+    if (cut) { flash.dead = true; }
+    return cut ? ESP_FAIL : ESP_OK;
+}
+
+static void power_up(size_t cut_at, size_t torn) {
+    flash.ops = 0;
+    flash.cut_at = cut_at;
+    flash.torn = torn;
+    flash.dead = false;
+}
+
+static cb_storage fault_storage() {
+    cb_storage storage;
+    storage.read = fault_read;
+    storage.write = fault_write;
+    storage.erase = fault_erase;
+    storage.ctx = NULL;
+    storage.size = FLASH_SIZE;
+    storage.sector_size = SECTOR_SIZE;
+    storage.mapped = NULL;
+    storage.release = NULL;
+    storage.load_header = NULL;
+    storage.store_header = NULL;
+    return storage;
+}
+
+struct harness_config {
+    const char* name;
+    cb_config config;
+};
+
+static size_t record_len(const cb_config& config, uint32_t id) {
+    return config.variable_length ? 4 + (id * 37) % (RECORD_SIZE - 4) : RECORD_SIZE;
+}
+
+static void fill(uint8_t* record, size_t len, uint32_t id) {
+    for (size_t i = 0; i < len; i++) { record[i] = (uint8_t)(id * 31 + i); }
+    memcpy(record, &id, sizeof(id));
+}
+
+/**
+ * What the application knows when the power is cut: ids are pushed in order from 0, ids below front were deleted
+ * and below back were pushed; acknowledged changes since the last commit that is known to be durable may be lost,
+ * the operation running at the cut may or may not have taken effect
+ */
+struct acked {
+    uint32_t back = 0;
+    uint32_t front = 0;
+    uint32_t durable_back = 0;
+    uint32_t durable_front = 0;
+    uint32_t pushing = 0;
+    uint32_t deleting = 0;
+};
+
+/**
+ * Runs the workload until it ends or the power is cut
+ * @return Number of results that contradicted the records pushed before, with power still on
+ */
+static int run_workload(const cb_config& config, acked* state) {
+    CircularBuffer cb;
+    if (cb.init(fault_storage(), RECORD_SIZE, config) != ESP_OK) { return flash.dead ? 0 : 1; }
+    // pushes are durable once their records and the header are written, deletes once the header is
+    bool pushes_deferred = config.cache_back;
+    bool deletes_deferred = config.record_crc;
+    int failures = 0;
+    uint8_t batch[MAX_BATCH * RECORD_SIZE];
+    uint8_t record[RECORD_SIZE];
+    uint32_t seed = 1;
+    for (int op = 0; op < WORKLOAD_OPS && !flash.dead; op++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = (seed >> 16) % 100;
+        state->pushing = state->deleting = 0;
+        esp_err_t err;
+        if (r < 45 || (r < 55 && config.variable_length)) {
+            size_t len = record_len(config, state->back);
+            fill(record, len, state->back);
+            state->pushing = 1;
+            err = config.variable_length ? cb.push_back(record, len) : cb.push_back(record);
+            if (err == ESP_OK) { state->back++; }
+        } else if (r < 55) {
+            uint32_t n = 2 + (seed >> 8) % (MAX_BATCH - 1);
+            for (uint32_t i = 0; i < n; i++) { fill(batch + i * RECORD_SIZE, RECORD_SIZE, state->back + i); }
+            state->pushing = n;
+            err = cb.push_back_n(batch, n);
+            if (err == ESP_OK) { state->back += n; }
+        } else if (r < 90) {
+            // with overwrite the front may have been dropped, so the id of the front is read first
+            size_t len = RECORD_SIZE;
+            err = config.variable_length ? cb.peek_front(record, RECORD_SIZE, &len) : cb.peek_front(record);
+            uint32_t id = state->front;
+            if (err == ESP_OK) { memcpy(&id, record, sizeof(id)); }
+            if (err == ESP_OK && (id < state->front || (!config.overwrite && id != state->front))) { failures++; }
+            uint32_t count = r < 85 ? 1 : 2;
+            state->deleting = id + count - state->front;
+            if (err == ESP_OK) { err = count == 1 ? cb.pop_front(record) : cb.delete_front_n(count); }
+            if (err == ESP_OK) { state->front = id + count; }
+        } else {
+            err = cb.flush();
+        }
+        if (flash.dead) { break; }
+        state->pushing = state->deleting = 0;
+        if (err == ESP_ERR_NO_MEM || err == ESP_ERR_NOT_FOUND) { continue; }
+        if (err != ESP_OK) {
+            failures++;
+            continue;
+        }
+        if (r >= 90 || !pushes_deferred) { state->durable_back = state->back; }
+        if (r >= 90 || !deletes_deferred) { state->durable_front = state->front; }
+        // without checksums a deletion commits the header, which writes the back sector cache
+        if (r >= 55 && r < 90 && !config.record_crc) { state->durable_back = state->back; }
+    }
+    return failures;
+}
+
+/**
+ * Initializes the buffer on the image left by the power cut and checks the records it recovered
+ * @return NULL if the records are consistent with what was acknowledged, else what is wrong
+ */
+static const char* check_recovery(const cb_config& config, const acked& state) {
+    power_up(SIZE_MAX, 0);
+    CircularBuffer cb;
+    if (cb.init(fault_storage(), RECORD_SIZE, config) != ESP_OK) { return "init failed"; }
+    uint32_t count = cb.get_record_num();
+    // without recovery mode a torn header commit starts an empty buffer
+    bool may_reset = !config.recovery_mode;
+    // recovery mode without checksums may count one record that was torn while it was pushed
+    bool may_tear = config.record_crc || (config.recovery_mode && state.pushing != 0);
+    uint32_t first = 0, next = 0, seen = 0;
+    bool torn = false;
+    uint8_t record[RECORD_SIZE], expected[RECORD_SIZE];
+    while (cb.get_record_num() > 0) {
+        if (torn) { return "records after a torn record"; }
+        size_t len = RECORD_SIZE;
+        esp_err_t err = config.variable_length ? cb.peek_front(record, RECORD_SIZE, &len) : cb.peek_front(record);
+        if (err == ESP_ERR_INVALID_CRC && config.record_crc) { torn = true; }
+        else if (err != ESP_OK) { return "peek failed"; }
+        else {
+            uint32_t id;
+            memcpy(&id, record, sizeof(id));
+            fill(expected, record_len(config, id), id);
+            if (len != record_len(config, id) || memcmp(record, expected, len) != 0 || (seen > 0 && id != next)) {
+                if (!may_tear || cb.get_record_num() != 1) { return "wrong record"; }
+                torn = true;
+            } else {
+                if (seen == 0) { first = id; }
+                next = id + 1;
+            }
+        }
+        seen++;
+        if (cb.delete_front() != ESP_OK) { return "delete failed"; }
+    }
+    if (seen != count) { return "record_num does not match the records"; }
+    if (count == 0 && may_reset) { return NULL; }
+    uint32_t front_max = state.front + state.deleting;
+    uint32_t back_max = state.back + state.pushing;
+    if (seen > (torn ? 1u : 0u)) {
+        if (first < state.durable_front || (!config.overwrite && first > front_max)) { return "front out of range"; }
+        if (next < state.durable_back || next > back_max) { return "back out of range"; }
+    } else if (!config.overwrite && state.durable_back > front_max) {
+        return "durable records lost";
+    }
+    // the buffer keeps working after the recovery
+    uint32_t id = back_max;
+    for (int i = 0; i < 3; i++) {
+        size_t len = record_len(config, id + i);
+        fill(record, len, id + i);
+        if ((config.variable_length ? cb.push_back(record, len) : cb.push_back(record)) != ESP_OK) { return "push after recovery failed"; }
+    }
+    for (int i = 0; i < 3; i++) {
+        size_t len = RECORD_SIZE;
+        fill(expected, record_len(config, id + i), id + i);
+        esp_err_t err = config.variable_length ? cb.pop_front(record, RECORD_SIZE, &len) : cb.pop_front(record);
+        if (err != ESP_OK || memcmp(record, expected, record_len(config, id + i)) != 0) { return "pop after recovery failed"; }
+    }
+    return NULL;
+}
+
+/**
+ * Cuts the power at every write and erase of the workload, before the operation and at torn points inside it,
+ * and checks the recovery with and without recovery_mode
+ * @return Number of failed checks
+ */
+static int sweep(const harness_config& hc) {
+    std::vector<flash_op> trace;
+    memset(flash.image, 0xFF, sizeof(flash.image));
+    power_up(SIZE_MAX, 0);
+    flash.trace = &trace;
+    acked clean;
+    int failures = run_workload(hc.config, &clean);
+    flash.trace = NULL;
+
+    size_t cuts = 0;
+    int printed = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        // torn points: nothing written, half of the first page and every page boundary inside the operation
+        std::vector<size_t> torn_points = { 0 };
+        if (trace[i].erase) { torn_points.push_back(1); }
+        else {
+            size_t first_page = PAGE_SIZE - trace[i].addr % PAGE_SIZE;
+            if (trace[i].len > 1) { torn_points.push_back((first_page < trace[i].len ? first_page : trace[i].len) / 2); }
+            for (size_t at = first_page; at < trace[i].len; at += PAGE_SIZE) { torn_points.push_back(at); }
+        }
+        for (size_t torn : torn_points) {
+            memset(flash.image, 0xFF, sizeof(flash.image));
+            power_up(i, torn);
+            acked state;
+            failures += run_workload(hc.config, &state);
+            static uint8_t crashed[FLASH_SIZE];
+            memcpy(crashed, flash.image, sizeof(crashed));
+            for (int recovery = 0; recovery < 2; recovery++) {
+                cb_config config = hc.config;
+                config.recovery_mode = recovery;
+                memcpy(flash.image, crashed, sizeof(crashed));
+                const char* problem = check_recovery(config, state);
+                if (problem == NULL) { continue; }
+                failures++;
+                if (printed++ < PRINTED_FAILURES) {
+                    printf("  %s: cut at %s %zu of %zu, torn %zu, recovery_mode %d: %s\n", hc.name, trace[i].erase ? "erase" : "write",
+                        i, trace.size(), torn, recovery, problem);
+                }
+            }
+            cuts++;
+        }
+    }
+    printf("%-16s records %5u, flash operations %5zu, cuts %6zu, failures: %d\n", hc.name, clean.back, trace.size(), cuts, failures);
+    return failures;
+}
+
+int main() {
+    std::vector<harness_config> configs;
+    harness_config plain = { "plain", cb_config() };
+    configs.push_back(plain);
+    harness_config journal = { "journal", cb_config() };
+    journal.config.journal = true;
+    configs.push_back(journal);
+    harness_config overwrite = { "overwrite", cb_config() };
+    overwrite.config.journal = true;
+    overwrite.config.overwrite = true;
+    configs.push_back(overwrite);
+    harness_config cached = { "cache", cb_config() };
+    cached.config.journal = true;
+    cached.config.cache_back = true;
+    cached.config.flush_records = 4;
+    configs.push_back(cached);
+    harness_config crc = { "crc", cb_config() };
+    crc.config.journal = true;
+    crc.config.record_crc = true;
+    crc.config.checkpoint_records = 8;
+    configs.push_back(crc);
+    harness_config crc_cached = { "crc+cache", crc.config };
+    crc_cached.config.cache_back = true;
+    crc_cached.config.overwrite = true;
+    configs.push_back(crc_cached);
+    harness_config crc_sealed = { "crc+seal", crc.config };
+    crc_sealed.config.checkpoint_records = 64;
+    crc_sealed.config.seal_sectors = true;
+    configs.push_back(crc_sealed);
+    harness_config span = { "span", cb_config() };
+    span.config.journal = true;
+    span.config.span_sectors = true;
+    span.config.record_crc = true;
+    configs.push_back(span);
+    harness_config variable = { "variable", cb_config() };
+    variable.config.journal = true;
+    variable.config.variable_length = true;
+    configs.push_back(variable);
+    harness_config variable_crc = { "variable+crc", variable.config };
+    variable_crc.config.record_crc = true;
+    variable_crc.config.checkpoint_records = 8;
+    configs.push_back(variable_crc);
+    harness_config variable_sealed = { "variable+seal", variable.config };
+    variable_sealed.config.seal_sectors = true;
+    configs.push_back(variable_sealed);
+    harness_config variable_crc_sealed = { "var+crc+seal", variable_crc.config };
+    variable_crc_sealed.config.checkpoint_records = 64;
+    variable_crc_sealed.config.seal_sectors = true;
+    configs.push_back(variable_crc_sealed);
+
+    int failures = 0;
+    for (const harness_config& hc : configs) { failures += sweep(hc); }
+    printf("Power loss, failures: %d\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef ESP_PLATFORM
+#include "esp_rom_crc.h"
+
+/**
+ * CRC-32 (IEEE 802.3, reflected) of a buffer, continuing from the CRC of the data before it
+ * On the device the CRC routine in ROM is used
+ * @param crc CRC of the preceding data, 0 to start
+ * @return CRC of the preceding data and the buffer
+ */
+static inline uint32_t cb_crc32(uint32_t crc, const uint8_t* buf, size_t len) { return esp_rom_crc32_le(crc, buf, len); }
+#else
+
+struct cb_crc_table {
+    uint32_t entries[8][256];
+};
+
+/**
+ * Builds the tables of slicing-by-8, entries[k][i] is the CRC of byte i followed by k zero bytes
+ */
+static constexpr cb_crc_table cb_make_crc_table() {
+    cb_crc_table table = {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) { c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1; }
+        table.entries[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = table.entries[k - 1][i];
+            table.entries[k][i] = (c >> 8) ^ table.entries[0][c & 0xFF];
+        }
+    }
+    return table;
+}
+
+// generated at compile time so no initialization call is needed
+static constexpr cb_crc_table CB_CRC_TABLE = cb_make_crc_table();
+
+/**
+ * CRC-32 (IEEE 802.3, reflected) of a buffer, continuing from the CRC of the data before it
+ * On the host eight bytes are folded per step with slicing-by-8, giving the same results as the ROM routine
+ * @param crc CRC of the preceding data, 0 to start
+ * @return CRC of the preceding data and the buffer
+ */
+static inline uint32_t cb_crc32(uint32_t crc, const uint8_t* buf, size_t len) {
+    const uint32_t (*t)[256] = CB_CRC_TABLE.entries;
+    crc = ~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint32_t low, high;
+        memcpy(&low, buf, sizeof(low));
+        memcpy(&high, buf + 4, sizeof(high));
+        low ^= crc;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+#endif
+    for (; len > 0; buf++, len--) { crc = (crc >> 8) ^ t[0][(crc ^ *buf) & 0xFF]; }
+    return ~crc;
+}
+#endif
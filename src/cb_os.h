@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#else
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#define CB_WAIT_FOREVER UINT32_MAX
+
+/**
+ * Recursive mutex backed by a FreeRTOS semaphore on the device and std::recursive_mutex on the host
+ */
+class CbMutex {
+    public:
+        CbMutex() = default;
+        CbMutex(const CbMutex&) = delete;
+        CbMutex& operator=(const CbMutex&) = delete;
+#ifdef ESP_PLATFORM
+        ~CbMutex() { if (handle != NULL) { vSemaphoreDelete(handle); } }
+        bool init() {
+            if (handle == NULL) { handle = xSemaphoreCreateRecursiveMutex(); }
+            return handle != NULL;
+        }
+        void lock() { xSemaphoreTakeRecursive(handle, portMAX_DELAY); }
+        void unlock() { xSemaphoreGiveRecursive(handle); }
+    private:
+        SemaphoreHandle_t handle = NULL;
+#else
+        bool init() { return true; }
+        void lock() { mutex.lock(); }
+        void unlock() { mutex.unlock(); }
+    private:
+        std::recursive_mutex mutex;
+#endif
+};
+
+/**
+ * Holds a mutex for the lifetime of the guard, does nothing for NULL so unlocked modes cost a branch
+ */
+class CbGuard {
+    public:
+        explicit CbGuard(CbMutex* mutex) : mutex(mutex) { if (mutex != NULL) { mutex->lock(); } }
+        CbGuard(const CbGuard&) = delete;
+        CbGuard& operator=(const CbGuard&) = delete;
+        ~CbGuard() { if (mutex != NULL) { mutex->unlock(); } }
+    private:
+        CbMutex* mutex;
+};
+
+/**
+ * Counting semaphore used to wake up waiting tasks, give() beyond max is dropped
+ */
+class CbSemaphore {
+    public:
+        CbSemaphore() = default;
+        CbSemaphore(const CbSemaphore&) = delete;
+        CbSemaphore& operator=(const CbSemaphore&) = delete;
+#ifdef ESP_PLATFORM
+        ~CbSemaphore() { if (handle != NULL) { vSemaphoreDelete(handle); } }
+        bool init(uint32_t max) {
+            if (handle == NULL) { handle = xSemaphoreCreateCounting(max, 0); }
+            return handle != NULL;
+        }
+        bool take(uint32_t timeout_ms) {
+            return xSemaphoreTake(handle, timeout_ms == CB_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+        }
+        void give() { xSemaphoreGive(handle); }
+    private:
+        SemaphoreHandle_t handle = NULL;
+#else
+        bool init(uint32_t max) {
+            this->max = max;
+            return true;
+        }
+        bool take(uint32_t timeout_ms) {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto given = [this]() { return count > 0; };
+            if (timeout_ms == CB_WAIT_FOREVER) { cv.wait(lock, given); }
+            else if (!cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), given)) { return false; }
+            count--;
+            return true;
+        }
+        void give() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (count < max) { count++; }
+            }
+            cv.notify_one();
+        }
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint32_t count = 0;
+        uint32_t max = 1;
+#endif
+};
+
+/**
+ * Background task, a FreeRTOS task on the device and a std::thread on the host
+ */
+class CbTask {
+    public:
+        CbTask() = default;
+        CbTask(const CbTask&) = delete;
+        CbTask& operator=(const CbTask&) = delete;
+        ~CbTask() { join(); }
+#ifdef ESP_PLATFORM
+        bool start(void (*entry)(void*), void* arg, const char* name, uint32_t stack, uint32_t priority) {
+            if (!done.init(1)) { return false; }
+            this->entry = entry;
+            this->arg = arg;
+            running = xTaskCreate(run, name, stack, this, priority, NULL) == pdPASS;
+            return running;
+        }
+        // waits for the entry function to return
+        void join() {
+            if (running) { done.take(CB_WAIT_FOREVER); }
+            running = false;
+        }
+    private:
+        static void run(void* self) {
+            CbTask* task = (CbTask*)self;
+            task->entry(task->arg);
+            task->done.give();
+            vTaskDelete(NULL);
+        }
+        void (*entry)(void*) = NULL;
+        void* arg = NULL;
+        CbSemaphore done;
+        bool running = false;
+#else
+        // the name, stack size and priority only apply to FreeRTOS tasks
+        bool start(void (*entry)(void*), void* arg, const char*, uint32_t, uint32_t) {
+            thread = std::thread(entry, arg);
+            return true;
+        }
+        // waits for the entry function to return
+        void join() { if (thread.joinable()) { thread.join(); } }
+    private:
+        std::thread thread;
+#endif
+};
@@ -0,0 +1,395 @@
+#include "cb_pool.h"
+
+#include "cb_crc.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#define POOL_MAGIC 0xB17A6
+#define JOURNAL_SECS 2
+#define FREE 0xFF
+#define UNMAPPED 0xFFFF
+
+// defined in circular_buffer.cpp
+bool is_all_ff(const void *ptr, size_t len);
+bool is_newer(uint32_t sequence, uint32_t than);
+
+static uint32_t tag_crc(const cb_pool_tag* tag) {
+    cb_pool_tag copy = *tag;
+    copy.live = 0xFF;
+    return cb_crc32(0, (const uint8_t*)&copy, offsetof(struct cb_pool_tag, crc));
+}
+
+static uint32_t entry_crc(const cb_pool_entry* entry) {
+    return cb_crc32(0, (const uint8_t*)entry, offsetof(struct cb_pool_entry, crc));
+}
+
+CbPool::~CbPool() { free_streams(); }
+
+void CbPool::free_streams() {
+    for (size_t i = 0; streams != NULL && i < stream_count; i++) { free(streams[i].map); }
+    free(streams);
+    free(owner);
+    free(owner_vsec);
+    streams = NULL;
+    owner = NULL;
+    owner_vsec = NULL;
+}
+
+/**
+ * Mounts a pool, recovering the owners of its sectors and the headers of its streams
+ * A storage that does not hold a pool yet starts with every data sector free
+ * @param storage flash shared by the streams, copied
+ * @param count number of streams, their ids are 0 to count - 1
+ * @return ESP_OK if ok, ESP_ERR_INVALID_SIZE if the storage has less than three sectors
+ */
+esp_err_t CbPool::init(const cb_storage& storage, uint8_t count) {
+    if (storage.sector_size <= CB_POOL_TAG_SIZE || storage.size / storage.sector_size < JOURNAL_SECS + 1 ||
+        storage.size / storage.sector_size >= UNMAPPED) { return ESP_ERR_INVALID_SIZE; }
+    // a slot being compacted takes the header of every stream and the commit that filled the other one
+    if (count == 0 || count == FREE || count + 1u > storage.sector_size / sizeof(cb_pool_entry)) { return ESP_ERR_INVALID_ARG; }
+    if (!mutex.init()) { return ESP_ERR_NO_MEM; }
+    CbGuard guard(&mutex);
+    free_streams();
+    this->storage = storage;
+    sec_size = storage.sector_size;
+    vsec_size = sec_size - CB_POOL_TAG_SIZE;
+    sec_count = storage.size / sec_size;
+    stream_count = count;
+    streams = (stream_ctx*)calloc(count, sizeof(stream_ctx));
+    owner = (uint8_t*)malloc(sec_count);
+    owner_vsec = (uint16_t*)malloc(sec_count * sizeof(uint16_t));
+    if (streams == NULL || owner == NULL || owner_vsec == NULL) {
+        free_streams();
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        streams[i].pool = this;
+        streams[i].id = i;
+    }
+    esp_err_t err = load_tags();
+    if (err == ESP_OK) { err = load_journal(); }
+    return err;
+}
+
+/**
+ * Sets up the storage of a stream, its circular buffer is then initialized on it
+ * The storage is copied by the circular buffer and refers to the pool, which must outlive it
+ * @param id stream id
+ * @param storage storage to set up
+ * @param max_sectors most data sectors the stream may hold, 0 for all of them; the sum over the streams may exceed
+ * the pool, a push then returns ESP_ERR_NO_MEM while no sector is free
+ * @return ESP_OK if ok
+ */
+esp_err_t CbPool::stream(uint8_t id, cb_storage* storage, size_t max_sectors) {
+    CbGuard guard(&mutex);
+    if (streams == NULL || id >= stream_count) { return ESP_ERR_INVALID_ARG; }
+    size_t data_secs = sec_count - JOURNAL_SECS;
+    if (max_sectors > data_secs) { return ESP_ERR_INVALID_SIZE; }
+    if (max_sectors == 0) { max_sectors = data_secs; }
+    stream_ctx* s = &streams[id];
+    free(s->map);
+    s->map = (uint16_t*)malloc(max_sectors * sizeof(uint16_t));
+    if (s->map == NULL) { return ESP_ERR_NO_MEM; }
+    for (size_t i = 0; i < max_sectors; i++) { s->map[i] = UNMAPPED; }
+    for (uint16_t sec = JOURNAL_SECS; sec < sec_count; sec++) {
+        if (owner[sec] != id) { continue; }
+        uint16_t vsec = owner_vsec[sec];
+        if (vsec < max_sectors && s->map[vsec] == UNMAPPED) {
+            s->map[vsec] = sec;
+            continue;
+        }
+        // left over from a larger stream
+        esp_err_t err = release_sec(sec);
+        if (err != ESP_OK) { return err; }
+    }
+    storage->read = stream_read;
+    storage->write = stream_write;
+    storage->erase = stream_erase;
+    storage->ctx = s;
+    storage->size = max_sectors * vsec_size;
+    storage->sector_size = vsec_size;
+    // consecutive virtual sectors are scattered over the pool
+    storage->mapped = NULL;
+    storage->release = stream_release;
+    storage->load_header = stream_load_header;
+    storage->store_header = stream_store_header;
+    return ESP_OK;
+}
+
+/**
+ * @return Number of data sectors that no stream holds
+ */
+size_t CbPool::get_free_sectors() {
+    CbGuard guard(&mutex);
+    return free_secs;
+}
+
+esp_err_t CbPool::read_phys(size_t addr, void* dest, size_t len) {
+    if (storage.mapped != NULL) {
+        memcpy(dest, storage.mapped + addr, len);
+        return ESP_OK;
+    }
+    return storage.read(storage.ctx, addr, dest, len);
+}
+
+/**
+ * Reads the tag of every data sector, a sector without a valid live tag is free
+ * Of two live sectors claiming the same virtual sector of a stream the one with the newer tag is kept, the other is
+ * released. Allocation continues after the sector allocated last
+ * @return ESP_OK if ok
+ */
+esp_err_t CbPool::load_tags() {
+    uint32_t* sequences = (uint32_t*)malloc(sec_count * sizeof(uint32_t));
+    if (sequences == NULL) { return ESP_ERR_NO_MEM; }
+    free_secs = 0;
+    alloc_next = JOURNAL_SECS;
+    alloc_sequence = 0;
+    bool any = false;
+    esp_err_t err = ESP_OK;
+    for (uint16_t sec = JOURNAL_SECS; sec < sec_count && err == ESP_OK; sec++) {
+        cb_pool_tag tag;
+        err = read_phys((size_t)sec * sec_size, &tag, sizeof(tag));
+        if (err != ESP_OK) { break; }
+        bool valid = tag.magic == POOL_MAGIC && tag.crc == tag_crc(&tag);
+        if (valid && tag.live == 0xFF && tag.stream < stream_count) {
+            owner[sec] = tag.stream;
+            owner_vsec[sec] = tag.vsec;
+            sequences[sec] = tag.sequence;
+            uint16_t twin = JOURNAL_SECS;
+            while (twin < sec && (owner[twin] != tag.stream || owner_vsec[twin] != tag.vsec)) { twin++; }
+            if (twin < sec) { err = release_sec(is_newer(tag.sequence, sequences[twin]) ? twin : sec); }
+        } else {
+            owner[sec] = FREE;
+            free_secs++;
+        }
+        if (valid && (!any || is_newer(tag.sequence, alloc_sequence))) {
+            any = true;
+            alloc_sequence = tag.sequence;
+            alloc_next = sec + 1 == sec_count ? JOURNAL_SECS : sec + 1;
+        }
+    }
+    free(sequences);
+    return err;
+}
+
+/**
+ * Scans both journal slots for the newest header of every stream
+ * The slot holding the newest entry is the active one; a stream whose newest header is only in the other slot
+ * was not yet copied when moving to the active slot was interrupted, so that copy is completed
+ * @return ESP_OK if ok
+ */
+esp_err_t CbPool::load_journal() {
+    size_t entries = sec_size / sizeof(cb_pool_entry);
+    cb_pool_entry* slot_entries = (cb_pool_entry*)malloc(entries * sizeof(cb_pool_entry));
+    if (slot_entries == NULL) { return ESP_ERR_NO_MEM; }
+    uint32_t* newest_slot = (uint32_t*)calloc(stream_count, sizeof(uint32_t));
+    if (newest_slot == NULL) {
+        free(slot_entries);
+        return ESP_ERR_NO_MEM;
+    }
+    size_t used[JOURNAL_SECS];
+    bool any = false;
+    journal_slot = 0;
+    journal_sequence = 0;
+    esp_err_t err = ESP_OK;
+    for (uint32_t slot = 0; slot < JOURNAL_SECS && err == ESP_OK; slot++) {
+        used[slot] = 0;
+        err = read_phys(slot * sec_size, slot_entries, entries * sizeof(cb_pool_entry));
+        for (size_t i = 0; i < entries && err == ESP_OK; i++) {
+            const cb_pool_entry* e = &slot_entries[i];
+            if (is_all_ff(e, sizeof(*e))) { continue; }
+            // a torn entry can't be written again, appending continues after it
+            used[slot] = i + 1;
+            if (e->crc != entry_crc(e) || e->stream >= stream_count || e->len == 0 || e->len > CB_POOL_HEADER_SIZE) { continue; }
+            stream_ctx* s = &streams[e->stream];
+            if (s->header_len == 0 || is_newer(e->sequence, s->sequence)) {
+                memcpy(s->header, e->header, e->len);
+                s->header_len = e->len;
+                s->sequence = e->sequence;
+                newest_slot[e->stream] = slot;
+            }
+            if (!any || is_newer(e->sequence, journal_sequence)) {
+                any = true;
+                journal_sequence = e->sequence;
+                journal_slot = slot;
+            }
+        }
+    }
+    if (err == ESP_OK) { journal_pos = used[journal_slot]; }
+    for (uint8_t i = 0; i < stream_count && err == ESP_OK; i++) {
+        if (streams[i].header_len != 0 && newest_slot[i] != journal_slot) {
+            err = append_entry(i, streams[i].header, streams[i].header_len);
+        }
+    }
+    free(newest_slot);
+    free(slot_entries);
+    return err;
+}
+
+/**
+ * Appends a header to the active journal slot
+ * A full slot is replaced by the other one, which is erased and starts with the newest header of every other stream
+ * @return ESP_OK if ok
+ */
+esp_err_t CbPool::append_entry(uint8_t id, const void* header, size_t len) {
+    size_t entries = sec_size / sizeof(cb_pool_entry);
+    if (journal_pos >= entries) {
+        journal_slot ^= 1;
+        journal_pos = 0;
+        esp_err_t err = storage.erase(storage.ctx, journal_slot * sec_size, sec_size);
+        if (err != ESP_OK) { return err; }
+        for (uint8_t i = 0; i < stream_count; i++) {
+            if (i == id || streams[i].header_len == 0) { continue; }
+            err = append_entry(i, streams[i].header, streams[i].header_len);
+            if (err != ESP_OK) { return err; }
+        }
+    }
+    cb_pool_entry entry;
+    memset(&entry, 0xFF, sizeof(entry));
+    entry.sequence = ++journal_sequence;
+    entry.stream = id;
+    entry.len = len;
+    memcpy(entry.header, header, len);
+    entry.crc = entry_crc(&entry);
+    size_t addr = journal_slot * sec_size + journal_pos * sizeof(cb_pool_entry);
+    journal_pos++;
+    esp_err_t err = storage.write(storage.ctx, addr, &entry, sizeof(entry));
+    if (err != ESP_OK) { return err; }
+    streams[id].sequence = entry.sequence;
+    return ESP_OK;
+}
+
+esp_err_t CbPool::write_tag(uint16_t sec, uint8_t id, uint16_t vsec) {
+    cb_pool_tag tag;
+    tag.magic = POOL_MAGIC;
+    tag.stream = id;
+    tag.live = 0xFF;
+    tag.vsec = vsec;
+    tag.sequence = ++alloc_sequence;
+    tag.crc = tag_crc(&tag);
+    return storage.write(storage.ctx, (size_t)sec * sec_size, &tag, sizeof(tag));
+}
+
+/**
+ * Erases a virtual sector of a stream, allocating a free sector first if it has none
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if every sector of the pool is held by a stream
+ */
+esp_err_t CbPool::assign(stream_ctx* s, size_t vsec) {
+    uint16_t sec = s->map[vsec];
+    if (sec == UNMAPPED) {
+        if (free_secs == 0) { return ESP_ERR_NO_MEM; }
+        while (owner[alloc_next] != FREE) { alloc_next = alloc_next + 1 == sec_count ? JOURNAL_SECS : alloc_next + 1; }
+        sec = alloc_next;
+        alloc_next = alloc_next + 1 == sec_count ? JOURNAL_SECS : alloc_next + 1;
+        owner[sec] = s->id;
+        owner_vsec[sec] = vsec;
+        s->map[vsec] = sec;
+        free_secs--;
+    }
+    // an interrupted erase leaves the sector without a tag, so it reads as a free and erased sector again
+    esp_err_t err = storage.erase(storage.ctx, (size_t)sec * sec_size, sec_size);
+    if (err != ESP_OK) { return err; }
+    return write_tag(sec, s->id, vsec);
+}
+
+/**
+ * Returns a data sector to the free sectors by clearing the live byte of its tag
+ * @return ESP_OK if ok
+ */
+esp_err_t CbPool::release_sec(uint16_t sec) {
+    uint8_t dead = 0;
+    esp_err_t err = storage.write(storage.ctx, (size_t)sec * sec_size + offsetof(struct cb_pool_tag, live), &dead, 1);
+    if (err != ESP_OK) { return err; }
+    owner[sec] = FREE;
+    free_secs++;
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_read(void* ctx, size_t addr, void* dest, size_t len) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbPool* pool = s->pool;
+    CbGuard guard(&pool->mutex);
+    uint8_t* out = (uint8_t*)dest;
+    while (len > 0) {
+        size_t vsec = addr / pool->vsec_size;
+        size_t offset = addr % pool->vsec_size;
+        size_t chunk = pool->vsec_size - offset < len ? pool->vsec_size - offset : len;
+        uint16_t sec = s->map[vsec];
+        // a sector the stream does not hold reads as erased
+        if (sec == UNMAPPED) { memset(out, 0xFF, chunk); }
+        else {
+            esp_err_t err = pool->read_phys((size_t)sec * pool->sec_size + CB_POOL_TAG_SIZE + offset, out, chunk);
+            if (err != ESP_OK) { return err; }
+        }
+        addr += chunk;
+        out += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_write(void* ctx, size_t addr, const void* src, size_t len) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbPool* pool = s->pool;
+    CbGuard guard(&pool->mutex);
+    const uint8_t* in = (const uint8_t*)src;
+    while (len > 0) {
+        size_t vsec = addr / pool->vsec_size;
+        size_t offset = addr % pool->vsec_size;
+        size_t chunk = pool->vsec_size - offset < len ? pool->vsec_size - offset : len;
+        uint16_t sec = s->map[vsec];
+        // sectors are allocated when they are erased, which always precedes writing them
+        if (sec == UNMAPPED) { return ESP_ERR_INVALID_STATE; }
+        esp_err_t err = pool->storage.write(pool->storage.ctx, (size_t)sec * pool->sec_size + CB_POOL_TAG_SIZE + offset, in, chunk);
+        if (err != ESP_OK) { return err; }
+        addr += chunk;
+        in += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_erase(void* ctx, size_t addr, size_t len) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbPool* pool = s->pool;
+    CbGuard guard(&pool->mutex);
+    for (size_t vsec = addr / pool->vsec_size; vsec < (addr + len) / pool->vsec_size; vsec++) {
+        esp_err_t err = pool->assign(s, vsec);
+        if (err != ESP_OK) { return err; }
+    }
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_release(void* ctx, size_t addr, size_t len) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbPool* pool = s->pool;
+    CbGuard guard(&pool->mutex);
+    for (size_t vsec = addr / pool->vsec_size; vsec < (addr + len) / pool->vsec_size; vsec++) {
+        if (s->map[vsec] == UNMAPPED) { continue; }
+        esp_err_t err = pool->release_sec(s->map[vsec]);
+        if (err != ESP_OK) { return err; }
+        s->map[vsec] = UNMAPPED;
+    }
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_load_header(void* ctx, void* header, size_t len, bool* found) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbGuard guard(&s->pool->mutex);
+    *found = s->header_len == len;
+    if (*found) { memcpy(header, s->header, len); }
+    return ESP_OK;
+}
+
+esp_err_t CbPool::stream_store_header(void* ctx, const void* header, size_t len) {
+    stream_ctx* s = (stream_ctx*)ctx;
+    CbGuard guard(&s->pool->mutex);
+    if (len == 0 || len > CB_POOL_HEADER_SIZE) { return ESP_ERR_INVALID_SIZE; }
+    esp_err_t err = s->pool->append_entry(s->id, header, len);
+    if (err != ESP_OK) { return err; }
+    memcpy(s->header, header, len);
+    s->header_len = len;
+    return ESP_OK;
+}
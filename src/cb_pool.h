@@ -0,0 +1,91 @@
+#pragma once
+
+#include "cb_os.h"
+#include "cb_storage.h"
+
+// largest header a stream may store in the shared journal
+#define CB_POOL_HEADER_SIZE 40
+// bytes at the start of every data sector naming the stream and virtual sector it belongs to
+#define CB_POOL_TAG_SIZE 16
+
+// written at the start of a data sector when it is allocated to a stream
+struct cb_pool_tag {
+    uint32_t magic;
+    uint8_t stream;
+    // 0xFF while the sector is owned, cleared in place when it is released, not covered by crc
+    uint8_t live;
+    uint16_t vsec;
+    uint32_t sequence;
+    uint32_t crc;
+};
+
+// header of one stream, appended to the active journal slot on every commit
+struct cb_pool_entry {
+    uint32_t sequence;
+    uint8_t stream;
+    uint8_t len;
+    uint16_t unused;
+    uint8_t header[CB_POOL_HEADER_SIZE];
+    uint32_t crc;
+};
+
+/**
+ * Shares the sectors of one storage between several circular buffers, called streams
+ * The first two sectors hold one journal with the headers of every stream, the others are handed to streams
+ * when they enter a sector and given back once their front has left it, so an idle stream holds no more
+ * sectors than its records take. Every stream sees a storage of its own made of virtual sectors of
+ * sector_size - CB_POOL_TAG_SIZE bytes, the owner of a data sector is recorded in a tag at its start and
+ * recovered by init(). The pool must outlive the circular buffers of its streams.
+ */
+class CbPool {
+    public:
+        CbPool() = default;
+        CbPool(const CbPool&) = delete;
+        CbPool& operator=(const CbPool&) = delete;
+        ~CbPool();
+        esp_err_t init(const cb_storage& storage, uint8_t streams);
+        esp_err_t stream(uint8_t id, cb_storage* storage, size_t max_sectors = 0);
+        size_t get_free_sectors();
+    private:
+        struct stream_ctx {
+            CbPool* pool;
+            uint8_t id;
+            // physical sector of every virtual sector, UNMAPPED if it has none
+            uint16_t* map;
+            // newest header committed by the stream, header_len is 0 before the first commit
+            uint8_t header[CB_POOL_HEADER_SIZE];
+            uint8_t header_len;
+            uint32_t sequence;
+        };
+        static esp_err_t stream_read(void* ctx, size_t addr, void* dest, size_t len);
+        static esp_err_t stream_write(void* ctx, size_t addr, const void* src, size_t len);
+        static esp_err_t stream_erase(void* ctx, size_t addr, size_t len);
+        static esp_err_t stream_release(void* ctx, size_t addr, size_t len);
+        static esp_err_t stream_load_header(void* ctx, void* header, size_t len, bool* found);
+        static esp_err_t stream_store_header(void* ctx, const void* header, size_t len);
+        esp_err_t read_phys(size_t addr, void* dest, size_t len);
+        esp_err_t load_tags();
+        esp_err_t load_journal();
+        esp_err_t write_tag(uint16_t sec, uint8_t id, uint16_t vsec);
+        esp_err_t assign(stream_ctx* s, size_t vsec);
+        esp_err_t release_sec(uint16_t sec);
+        esp_err_t append_entry(uint8_t id, const void* header, size_t len);
+        void free_streams();
+        cb_storage storage;
+        size_t sec_size = 0;
+        size_t vsec_size = 0;
+        uint16_t sec_count = 0;
+        uint8_t stream_count = 0;
+        stream_ctx* streams = NULL;
+        // owner of every data sector, a stream id or FREE, and its virtual sector
+        uint8_t* owner = NULL;
+        uint16_t* owner_vsec = NULL;
+        size_t free_secs = 0;
+        // sectors are allocated round robin from alloc_next so erases are spread over the pool
+        uint16_t alloc_next = 0;
+        uint32_t alloc_sequence = 0;
+        uint32_t journal_slot = 0;
+        size_t journal_pos = 0;
+        uint32_t journal_sequence = 0;
+        CbMutex mutex;
+};
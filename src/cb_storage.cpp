@@ -0,0 +1,140 @@
+#include "cb_storage.h"
+
+#include <cstring>
+
+#ifdef ESP_PLATFORM
+#include "esp_idf_version.h"
+#endif
+
+static esp_err_t wl_storage_read(void* ctx, size_t addr, void* dest, size_t len) {
+    return wl_read((wl_handle_t)(intptr_t)ctx, addr, dest, len);
+}
+
+static esp_err_t wl_storage_write(void* ctx, size_t addr, const void* src, size_t len) {
+    return wl_write((wl_handle_t)(intptr_t)ctx, addr, src, len);
+}
+
+static esp_err_t wl_storage_erase(void* ctx, size_t addr, size_t len) {
+    return wl_erase_range((wl_handle_t)(intptr_t)ctx, addr, len);
+}
+
+/**
+ * Mounts the wear levelling layer on a partition and stores the circular buffer through it
+ * @param partition_name name of the data partition
+ * @param storage storage to set up
+ * @return ESP_OK if ok
+ */
+esp_err_t cb_storage_wl(const char* partition_name, cb_storage* storage) {
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_name);
+    if (partition == NULL) { return ESP_ERR_NOT_FOUND; }
+    wl_handle_t handle;
+    esp_err_t err = wl_mount(partition, &handle);
+    if (err != ESP_OK) { return err; }
+    storage->read = wl_storage_read;
+    storage->write = wl_storage_write;
+    storage->erase = wl_storage_erase;
+    storage->ctx = (void*)(intptr_t)handle;
+    storage->size = wl_size(handle);
+    storage->sector_size = wl_sector_size(handle);
+    // sectors are remapped by the wear levelling layer
+    storage->mapped = NULL;
+    storage->release = NULL;
+    storage->load_header = NULL;
+    storage->store_header = NULL;
+    return ESP_OK;
+}
+
+#ifdef ESP_PLATFORM
+static esp_err_t partition_storage_read(void* ctx, size_t addr, void* dest, size_t len) {
+    return esp_partition_read((const esp_partition_t*)ctx, addr, dest, len);
+}
+
+static esp_err_t partition_storage_write(void* ctx, size_t addr, const void* src, size_t len) {
+    return esp_partition_write((const esp_partition_t*)ctx, addr, src, len);
+}
+
+static esp_err_t partition_storage_erase(void* ctx, size_t addr, size_t len) {
+    return esp_partition_erase_range((const esp_partition_t*)ctx, addr, len);
+}
+
+/**
+ * Stores the circular buffer directly on a partition, without the wear levelling layer
+ * The circular buffer already writes its data sectors in rotation, only its two header slots are reused
+ * on every commit, so journal mode is recommended to spread those over the entries of a slot
+ * @param partition_name name of the data partition
+ * @param storage storage to set up
+ * @param map map the partition into the data address space so reads go through the flash cache, the mapping is
+ * kept for the lifetime of the program and takes MMU pages for the whole partition
+ * @return ESP_OK if ok
+ */
+esp_err_t cb_storage_partition(const char* partition_name, cb_storage* storage, bool map) {
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_name);
+    if (partition == NULL) { return ESP_ERR_NOT_FOUND; }
+    storage->mapped = NULL;
+    if (map) {
+        const void* base;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+        esp_partition_mmap_handle_t handle;
+#else
+        spi_flash_mmap_handle_t handle;
+#endif
+        // writes and erases through esp_partition_* invalidate the cached lines of the mapping
+        esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &base, &handle);
+        if (err != ESP_OK) { return err; }
+        storage->mapped = (const uint8_t*)base;
+    }
+    storage->read = partition_storage_read;
+    storage->write = partition_storage_write;
+    storage->erase = partition_storage_erase;
+    storage->ctx = (void*)partition;
+    storage->size = partition->size;
+    storage->sector_size = SPI_FLASH_SEC_SIZE;
+    storage->release = NULL;
+    storage->load_header = NULL;
+    storage->store_header = NULL;
+    return ESP_OK;
+}
+#endif
+
+// the circular buffer keeps its accesses within the storage, so the image is not bounds checked
+static esp_err_t ram_storage_read(void* ctx, size_t addr, void* dest, size_t len) {
+    memcpy(dest, (const uint8_t*)ctx + addr, len);
+    return ESP_OK;
+}
+
+static esp_err_t ram_storage_write(void* ctx, size_t addr, const void* src, size_t len) {
+    uint8_t* image = (uint8_t*)ctx + addr;
+    const uint8_t* data = (const uint8_t*)src;
+    for (size_t i = 0; i < len; i++) { image[i] &= data[i]; }
+    return ESP_OK;
+}
+
+static esp_err_t ram_storage_erase(void* ctx, size_t addr, size_t len) {
+    memset((uint8_t*)ctx + addr, 0xFF, len);
+    return ESP_OK;
+}
+
+/**
+ * Stores the circular buffer in memory with the semantics of NOR flash, for tests and volatile logs
+ * The image may be a plain buffer or a mapped file so its content outlives the process, a new image must be
+ * filled with 0xFF
+ * @param image memory holding the storage, must outlive the circular buffer
+ * @param size size of the image in bytes, a multiple of sector_size
+ * @param sector_size erase unit to emulate
+ * @param storage storage to set up
+ * @return ESP_OK if ok, ESP_ERR_INVALID_SIZE if size is not a whole number of sectors
+ */
+esp_err_t cb_storage_ram(uint8_t* image, size_t size, size_t sector_size, cb_storage* storage) {
+    if (sector_size == 0 || size == 0 || size % sector_size != 0) { return ESP_ERR_INVALID_SIZE; }
+    storage->read = ram_storage_read;
+    storage->write = ram_storage_write;
+    storage->erase = ram_storage_erase;
+    storage->ctx = image;
+    storage->size = size;
+    storage->sector_size = sector_size;
+    storage->mapped = image;
+    storage->release = NULL;
+    storage->load_header = NULL;
+    storage->store_header = NULL;
+    return ESP_OK;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "wear_levelling.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#endif
+
+/**
+ * Flash the circular buffer is stored on, addresses are relative to its start
+ * Writes follow NOR semantics: they can only clear bits, erase sets whole sectors back to 0xFF
+ */
+struct cb_storage {
+    esp_err_t (*read)(void* ctx, size_t addr, void* dest, size_t len);
+    esp_err_t (*write)(void* ctx, size_t addr, const void* src, size_t len);
+    // addr and len are multiples of sector_size
+    esp_err_t (*erase)(void* ctx, size_t addr, size_t len);
+    // passed to every call
+    void* ctx;
+    // size of the storage and its erase unit in bytes
+    size_t size;
+    size_t sector_size;
+    // the storage mapped into memory, NULL if it is not mapped; records are then read with plain loads and
+    // peek_front_ptr() and for_each() hand out pointers into it, so writes must keep the mapping coherent
+    const uint8_t* mapped;
+    // optional, NULL if not supported: gives back whole sectors that no longer hold records, called once the
+    // committed header stops referring to them; they are erased again before they are written
+    esp_err_t (*release)(void* ctx, size_t addr, size_t len);
+    // optional, NULL to keep the header in two slots at the start of the storage: loads and atomically replaces
+    // the header somewhere else, e.g. in a journal shared by several buffers, and the data area starts at 0
+    esp_err_t (*load_header)(void* ctx, void* header, size_t len, bool* found);
+    esp_err_t (*store_header)(void* ctx, const void* header, size_t len);
+};
+
+esp_err_t cb_storage_wl(const char* partition_name, cb_storage* storage);
+#ifdef ESP_PLATFORM
+esp_err_t cb_storage_partition(const char* partition_name, cb_storage* storage, bool map = false);
+#endif
+esp_err_t cb_storage_ram(uint8_t* image, size_t size, size_t sector_size, cb_storage* storage);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <optional>
+#endif
+
+#include "circular_buffer.h"
+
+/**
+ * Circular buffer of records of type T on a storage with sectors of SECTOR_SIZE bytes, both known at compile
+ * time, so every record moves by value and the geometry is checked when the program is built
+ * The records are stored by CircularBuffer, which remains the variant for sizes known at run time; T must be
+ * trivially copyable since its bytes are written to flash as they are
+ */
+template <typename T, size_t SECTOR_SIZE> class TypedCircularBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "records are stored as their bytes");
+    static_assert(SECTOR_SIZE != 0, "sectors hold records");
+    public:
+        /**
+         * Records held by one data sector when records don't span sectors, laid out as the circular buffer lays them
+         * out: with record_crc every record is followed by a 4 byte checksum, an aggregator footer takes its summary
+         * and a 4 byte checksum at the end of the sector, and a seal another 8 bytes
+         * @param aggregator_size size of the summary of the aggregator, 0 without one
+         * @return Number of records, 0 if a record doesn't fit in a sector
+         */
+        static constexpr size_t records_per_sector(bool record_crc = false, size_t aggregator_size = 0, bool seal_sectors = false) {
+            return SECTOR_SIZE < sector_overhead(aggregator_size, seal_sectors) ? 0 :
+                (SECTOR_SIZE - sector_overhead(aggregator_size, seal_sectors)) / (sizeof(T) + (record_crc ? sizeof(uint32_t) : 0));
+        }
+
+        /**
+         * Initializes the circular buffer on a storage whose sectors are SECTOR_SIZE bytes
+         * @param config options of the circular buffer, records have a fixed size
+         * @return ESP_OK if ok, ESP_ERR_INVALID_SIZE if the sector size differs or a record doesn't fit in a sector
+         */
+        esp_err_t init(const cb_storage& storage, const cb_config& config = cb_config()) {
+            if (storage.sector_size != SECTOR_SIZE) { return ESP_ERR_INVALID_SIZE; }
+            if (config.variable_length) { return ESP_ERR_INVALID_ARG; }
+            size_t aggregator_size = config.aggregator != NULL ? config.aggregator->size : 0;
+            if (!config.span_sectors && records_per_sector(config.record_crc, aggregator_size, config.seal_sectors) == 0) { return ESP_ERR_INVALID_SIZE; }
+            return cb.init(storage, sizeof(T), config);
+        }
+
+        /**
+         * Initializes the circular buffer on a wear levelled partition whose sectors are SECTOR_SIZE bytes
+         * @param partition_name name of partition in which circular buffer is going to be initialized
+         * @return ESP_OK if ok
+         */
+        esp_err_t init(const char* partition_name, const cb_config& config = cb_config()) {
+            cb_storage storage;
+            esp_err_t err = cb_storage_wl(partition_name, &storage);
+            if (err != ESP_OK) { return err; }
+            return init(storage, config);
+        }
+
+        esp_err_t push_back(const T& record) { return cb.push_back(&record, sizeof(T)); }
+        esp_err_t push_back_n(const T* records, size_t count) { return cb.push_back_n(records, count); }
+        esp_err_t push_back_async(const T& record, uint32_t timeout_ms = 0) { return cb.push_back_async(&record, sizeof(T), timeout_ms); }
+        esp_err_t peek_front(T* record) { return cb.peek_front(record); }
+        esp_err_t pop_front(T* record) { return cb.pop_front(record); }
+        esp_err_t pop_front_n(T* records, size_t max, size_t* out) { return cb.pop_front_n(records, max, out); }
+        esp_err_t read_at(size_t index, T* record) { return cb.read_at(index, record); }
+#if __cplusplus >= 201703L
+        /**
+         * @return The front record, nothing if the buffer is empty or the record could not be read
+         */
+        std::optional<T> peek_front() {
+            T record;
+            if (cb.peek_front(&record) != ESP_OK) { return std::nullopt; }
+            return record;
+        }
+
+        /**
+         * Removes the front record
+         * @return The record, nothing if the buffer is empty or the record could not be read (nothing is removed)
+         */
+        std::optional<T> pop_front() {
+            T record;
+            if (cb.pop_front(&record) != ESP_OK) { return std::nullopt; }
+            return record;
+        }
+#endif
+        esp_err_t delete_front() { return cb.delete_front(); }
+        esp_err_t delete_front_n(size_t count) { return cb.delete_front_n(count); }
+        esp_err_t clear() { return cb.clear(); }
+        esp_err_t flush() { return cb.flush(); }
+        uint32_t get_record_num() { return cb.get_record_num(); }
+        size_t get_max_records() { return cb.get_max_records(); }
+        esp_err_t get_stats(cb_stats* stats) { return cb.get_stats(stats); }
+        // the untyped buffer, for the calls that are not wrapped
+        CircularBuffer& buffer() { return cb; }
+    private:
+        static constexpr size_t sector_overhead(size_t aggregator_size, bool seal_sectors) {
+            return (aggregator_size != 0 ? aggregator_size + sizeof(uint32_t) : 0) + (seal_sectors ? 2 * sizeof(uint32_t) : 0);
+        }
+        CircularBuffer cb;
+};
@@ -1,10 +1,54 @@
 #include "circular_buffer.h"
 
-#include "esp_crc.h"
+#include "cb_crc.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <chrono>
+#endif
 
 #define MAGIC 0x5B15B1
+#define HEADER_VERSION 1
+// bits of cb_header::layout, the compression width is kept in the upper bits
+#define LAYOUT_LENGTH_PREFIX 0x01
+#define LAYOUT_CRC 0x02
+#define LAYOUT_SPAN 0x04
+#define LAYOUT_SEAL 0x08
+#define LAYOUT_COMPRESS_SHIFT 4
+#define LEN_SIZE sizeof(uint16_t)
+#define LEN_UNUSED 0xFFFF
+#define TAG_SIZE sizeof(uint32_t)
+// record count and its checksum
+#define SEAL_SIZE (sizeof(uint32_t) + TAG_SIZE)
+#define ASYNC_RETRY_MS 10
+
+#ifdef ESP_PLATFORM
+static int64_t now_ms() { return esp_timer_get_time() / 1000; }
+#else
+static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// counting compiles to nothing unless CB_STATS is defined
+#ifdef CB_STATS
+#define CB_STAT(statement) statement
+#ifdef ESP_PLATFORM
+static int64_t now_us() { return esp_timer_get_time(); }
+#else
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+#else
+#define CB_STAT(statement)
+#endif
 
 bool is_all_ff(const void *ptr, size_t len) {
     const uint8_t *p = (const uint8_t *)ptr;
@@ -16,36 +60,442 @@ bool is_all_ff(const void *ptr, size_t len) {
 
 void update_crc(struct cb_header *hdr) {
     hdr->crc = 0;
-    hdr->crc = esp_crc32_le(0, (const uint8_t*)hdr, sizeof(struct cb_header) - sizeof(uint32_t));
+    hdr->crc = cb_crc32(0, (const uint8_t*)hdr, offsetof(struct cb_header, crc));
 }
 
 bool check_header(const struct cb_header *hdr) {
-    uint32_t crc = esp_crc32_le(0, (const uint8_t*)hdr, sizeof(struct cb_header) - sizeof(uint32_t));
+    uint32_t crc = cb_crc32(0, (const uint8_t*)hdr, offsetof(struct cb_header, crc));
     return crc == hdr->crc && hdr->magic == MAGIC;
 }
 
-size_t CircularBuffer::secs_for_one_header() {
-    size_t sec_size = wl_sector_size(wl_handle);
-    return (sizeof(cb_header) + sec_size - 1) / sec_size;
+bool is_newer(uint32_t sequence, uint32_t than) { return (int32_t)(sequence - than) > 0; }
+
+// header of the format without a version, as shipped firmware laid it out on 32 bit targets: it predates record
+// checksums and so has no lap
+struct cb_legacy_header {
+    uint32_t magic;
+    uint32_t front;
+    uint32_t record_num;
+    uint32_t sequence;
+    uint32_t crc;
+};
+
+/**
+ * Reads a header entry of the current format
+ * @return Whether the entry is a valid header
+ */
+static bool decode_header(const uint8_t* entry, cb_header* header) {
+    memcpy(header, entry, sizeof(cb_header));
+    return check_header(header);
+}
+
+/**
+ * Reads a header entry of the format without a version, its layout is left unknown
+ * @return Whether the entry is a valid header
+ */
+static bool decode_legacy_header(const uint8_t* entry, cb_header* header) {
+    cb_legacy_header legacy;
+    memcpy(&legacy, entry, sizeof(legacy));
+    if (legacy.magic != MAGIC || cb_crc32(0, (const uint8_t*)&legacy, offsetof(cb_legacy_header, crc)) != legacy.crc) { return false; }
+    memset(header, 0, sizeof(cb_header));
+    header->magic = MAGIC;
+    header->front = legacy.front;
+    header->record_num = legacy.record_num;
+    header->sequence = legacy.sequence;
+    // laps only seed record checksums, which the format had none of
+    header->front_lap = 0;
+    return true;
 }
 
+size_t CircularBuffer::secs_for_one_header() { return (sizeof(cb_header) + sec_size - 1) / sec_size; }
+
 size_t CircularBuffer::secs_for_header() {
-    return 2 * secs_for_one_header();
+    // a header kept by the storage takes no sectors
+    return storage.store_header != NULL ? 0 : 2 * secs_for_one_header();
+}
+
+#ifdef CB_STATS
+/**
+ * Accounts for a storage call
+ * @param start time the call started at
+ * @param counter counter of what the call moved, increased by amount
+ */
+void CircularBuffer::count_flash(int64_t start, uint64_t* counter, uint64_t amount) {
+    uint32_t us = now_us() - start;
+    CbGuard stats_guard(stats_lock);
+    *counter += amount;
+    stats.flash_us += us;
+    if (us > stats.flash_max_us) { stats.flash_max_us = us; }
+}
+#endif
+
+esp_err_t CircularBuffer::flash_read(size_t addr, void* dest, size_t len) {
+    CB_STAT(int64_t start = now_us());
+    if (storage.mapped != NULL) {
+        memcpy(dest, storage.mapped + addr, len);
+        CB_STAT(count_flash(start, &stats.bytes_read, len));
+        return ESP_OK;
+    }
+    esp_err_t err = storage.read(storage.ctx, addr, dest, len);
+    if (err != ESP_OK && mirrored) { err = mirror_storage.read(mirror_storage.ctx, addr, dest, len); }
+    CB_STAT(count_flash(start, &stats.bytes_read, len));
+    return err;
+}
+
+esp_err_t CircularBuffer::flash_write(size_t addr, const void* src, size_t len) {
+    CB_STAT(int64_t start = now_us());
+    esp_err_t err = storage.write(storage.ctx, addr, src, len);
+    if (err == ESP_OK && mirrored) { err = mirror_storage.write(mirror_storage.ctx, addr, src, len); }
+    CB_STAT(count_flash(start, &stats.bytes_written, mirrored ? 2 * len : len));
+    return err;
+}
+
+esp_err_t CircularBuffer::flash_erase(size_t addr, size_t len) {
+    CB_STAT(int64_t start = now_us());
+    esp_err_t err = storage.erase(storage.ctx, addr, len);
+    if (err == ESP_OK && mirrored) { err = mirror_storage.erase(mirror_storage.ctx, addr, len); }
+    CB_STAT(count_flash(start, &stats.erases, (mirrored ? 2 : 1) * len / sec_size));
+    return err;
+}
+
+/**
+ * Caches the geometry of the storage so record operations need no calls into it
+ */
+void CircularBuffer::load_geometry() {
+    sec_size = storage.sector_size;
+    sec_pow2 = (sec_size & (sec_size - 1)) == 0;
+    sec_shift = 0;
+    while (((size_t)1 << sec_shift) < sec_size) { sec_shift++; }
+    slot_size = secs_for_one_header() * sec_size;
+    data_offset = secs_for_header() * sec_size;
+    sec_count = storage.size / sec_size - secs_for_header();
+    sec_space = sec_size - footer_size - seal_size;
+    sec_records = sec_space / frame_size;
+    ring_size = sec_count * sec_size;
+}
+
+size_t CircularBuffer::sec_index(size_t pos) { return sec_pow2 ? pos >> sec_shift : pos / sec_size; }
+
+size_t CircularBuffer::sec_offset(size_t pos) { return sec_pow2 ? pos & (sec_size - 1) : pos % sec_size; }
+
+/**
+ * @return Start of the sector following the one containing pos
+ */
+size_t CircularBuffer::next_sec(size_t pos) {
+    size_t sec = sec_index(pos) + 1;
+    return sec == sec_count ? 0 : sec * sec_size;
 }
 
-size_t CircularBuffer::header_offset() { return secs_for_header() * wl_sector_size(wl_handle); }
+/**
+ * @return Position len bytes after pos, wrapping around the end of the data area
+ */
+size_t CircularBuffer::ring_add(size_t pos, size_t len) {
+    pos += len;
+    while (pos >= ring_size) { pos -= ring_size; }
+    return pos;
+}
 
 esp_err_t CircularBuffer::write_header() {
+    esp_err_t err = flush_cache();
+    if (err != ESP_OK) { return err; }
+    header_dirty = false;
+    uncommitted = 0;
+    if (checkpoint_ms != 0) { last_commit_ms = now_ms(); }
+    size_t released = committed_front;
+    committed_front = front;
     cb_header header;
     header.magic = MAGIC;
+    header.version = HEADER_VERSION;
+    header.layout = layout;
+    header.footer_size = footer_size;
+    header.record_size = record_size;
     header.front = front;
     header.record_num = record_num;
     header.sequence = ++sequence;
+    header.front_lap = front_lap;
     update_crc(&header);
-    size_t addr = (sequence % 2) * secs_for_one_header() * wl_sector_size(wl_handle);
-    esp_err_t err = wl_erase_range(wl_handle, addr, secs_for_one_header() * wl_sector_size(wl_handle));
+    CB_STAT(stats.commits++);
+    if (storage.store_header != NULL) {
+        err = storage.store_header(storage.ctx, &header, sizeof(header));
+        if (err != ESP_OK) { return err; }
+        return release_secs(released);
+    }
+    if (!journal) {
+        size_t addr = (sequence % 2) * slot_size;
+        err = flash_erase(addr, slot_size);
+        if (err == ESP_OK) { err = flash_write(addr, &header, sizeof(header)); }
+        if (err != ESP_OK) { return err; }
+        return release_secs(released);
+    }
+    if (journal_pos >= slot_size / sizeof(cb_header)) {
+        journal_slot ^= 1;
+        journal_pos = 0;
+        err = flash_erase(journal_slot * slot_size, slot_size);
+        if (err != ESP_OK) { return err; }
+    }
+    size_t addr = journal_slot * slot_size + journal_pos * sizeof(cb_header);
+    journal_pos++;
+    err = flash_write(addr, &header, sizeof(header));
+    if (err != ESP_OK) { return err; }
+    return release_secs(released);
+}
+
+/**
+ * Gives the sectors the front has left since the previous commit back to the storage
+ * When the buffer wrapped within the back sector, the newest records are still in the sector the front left
+ * @param from front of the previous commit
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::release_secs(size_t from) {
+    bool mirror_release = mirrored && mirror_storage.release != NULL;
+    if (storage.release == NULL && !mirror_release) { return ESP_OK; }
+    size_t sec = sec_index(from);
+    size_t last = sec_index(front);
+    while (sec != last) {
+        if (sec != sec_index(back)) {
+            size_t addr = data_offset + sec * sec_size;
+            esp_err_t err = storage.release != NULL ? storage.release(storage.ctx, addr, sec_size) : ESP_OK;
+            if (err == ESP_OK && mirror_release) { err = mirror_storage.release(mirror_storage.ctx, addr, sec_size); }
+            if (err != ESP_OK) { return err; }
+        }
+        sec = sec + 1 == sec_count ? 0 : sec + 1;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Makes the two copies of a mirrored circular buffer identical before its header is loaded
+ * The copy with the newer header is kept, the storage when both are as new since it is written first; the sectors of
+ * the other copy that differ from it are rewritten, the header slots last, so an interrupted reconciliation is
+ * repeated from the same copy
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::reconcile() {
+    if (!mirrored) { return ESP_OK; }
+    cb_header newest[2];
+    bool found[2] = { false, false };
+    cb_storage primary = storage;
+    esp_err_t err = ESP_OK;
+    for (int copy = 0; err == ESP_OK && copy < 2; copy++) {
+        // the header slots of the mirror are read in place of those of the storage
+        storage = copy == 0 ? primary : mirror_storage;
+        for (uint32_t slot = 0; err == ESP_OK && slot < 2; slot++) {
+            cb_header header;
+            bool slot_found, torn;
+            size_t next_free;
+            err = read_header_slot(slot, &header, &slot_found, &torn, &next_free);
+            if (err == ESP_OK && slot_found && (!found[copy] || is_newer(header.sequence, newest[copy].sequence))) {
+                newest[copy] = header;
+                found[copy] = true;
+            }
+        }
+    }
+    storage = primary;
     if (err != ESP_OK) { return err; }
-    return wl_write(wl_handle, addr, &header, sizeof(header));
+    bool from_mirror = found[1] && (!found[0] || is_newer(newest[1].sequence, newest[0].sequence));
+    const cb_storage& from = from_mirror ? mirror_storage : storage;
+    const cb_storage& to = from_mirror ? storage : mirror_storage;
+    uint8_t* sectors = (uint8_t*)malloc(2 * sec_size);
+    if (sectors == NULL) { return ESP_ERR_NO_MEM; }
+    size_t count = storage.size / sec_size;
+    for (size_t i = 0; err == ESP_OK && i < count; i++) {
+        size_t addr = (i + secs_for_header()) % count * sec_size;
+        err = from.read(from.ctx, addr, sectors, sec_size);
+        if (err == ESP_OK) { err = to.read(to.ctx, addr, sectors + sec_size, sec_size); }
+        if (err != ESP_OK || memcmp(sectors, sectors + sec_size, sec_size) == 0) { continue; }
+        err = to.erase(to.ctx, addr, sec_size);
+        if (err == ESP_OK && !is_all_ff(sectors, sec_size)) { err = to.write(to.ctx, addr, sectors, sec_size); }
+    }
+    free(sectors);
+    return err;
+}
+
+/**
+ * Scans a header slot for its newest valid header
+ * In journal mode the whole slot is read and entries are scanned until the first erased one,
+ * otherwise only the first entry of the slot is considered
+ * @param slot index of the header slot
+ * @param newest newest valid header found in the slot
+ * @param found whether a valid header was found
+ * @param torn whether the last written entry of the slot is corrupted
+ * @param next_free index of the first erased entry of the slot
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::read_header_slot(uint32_t slot, cb_header* newest, bool* found, bool* torn, size_t* next_free) {
+    size_t len = journal ? slot_size : sizeof(cb_header);
+    uint8_t* entries = (uint8_t*)malloc(len);
+    if (entries == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = flash_read(slot * slot_size, entries, len);
+    if (err != ESP_OK) {
+        free(entries);
+        return err;
+    }
+    scan_slot(entries, len, sizeof(cb_header), decode_header, newest, found, torn, next_free);
+    if (!*found) {
+        // a slot written before headers had a version is read once, the next commit goes to a fresh slot
+        cb_header legacy;
+        bool legacy_found, legacy_torn;
+        size_t legacy_free;
+        scan_slot(entries, len, sizeof(cb_legacy_header), decode_legacy_header, &legacy, &legacy_found, &legacy_torn, &legacy_free);
+        if (legacy_found) {
+            *newest = legacy;
+            *found = true;
+            *torn = legacy_torn;
+            *next_free = slot_size / sizeof(cb_header);
+        }
+    }
+    free(entries);
+    return ESP_OK;
+}
+
+/**
+ * Scans header entries of one format laid out back to back, see read_header_slot()
+ * @param len length of the entries, only the first one is considered outside journal mode
+ * @param entry_size size of one entry
+ * @param decode reads one entry, returning whether it is valid
+ */
+void CircularBuffer::scan_slot(const uint8_t* entries, size_t len, size_t entry_size, bool (*decode)(const uint8_t* entry, cb_header* header),
+                               cb_header* newest, bool* found, bool* torn, size_t* next_free) {
+    size_t count = journal ? len / entry_size : 1;
+    *found = false;
+    *torn = false;
+    *next_free = count;
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* entry = entries + i * entry_size;
+        if (is_all_ff(entry, entry_size)) {
+            *next_free = i;
+            break;
+        }
+        cb_header header;
+        if (!decode(entry, &header)) {
+            *torn = true;
+            continue;
+        }
+        if (!*found || is_newer(header.sequence, newest->sequence)) { *newest = header; }
+        *found = true;
+        *torn = false;
+    }
+}
+
+/**
+ * Checks that the records on the storage were stored with the layout the circular buffer is configured with
+ * @param header newest header found on the storage
+ * @return ESP_OK if ok, ESP_ERR_INVALID_VERSION if the header has a newer format,
+ * ESP_ERR_INVALID_ARG if the records have another size or layout
+ */
+esp_err_t CircularBuffer::check_layout(const cb_header* header) {
+    // a header converted from the format without a version doesn't know the layout
+    if (header->version == 0) { return ESP_OK; }
+    if (header->version > HEADER_VERSION) { return ESP_ERR_INVALID_VERSION; }
+    if (header->layout != layout || header->footer_size != footer_size || header->record_size != record_size) { return ESP_ERR_INVALID_ARG; }
+    return ESP_OK;
+}
+
+/**
+ * Counts the record after the back of the circular buffer if it was written but its header was lost
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::recover_next_record() {
+    if (sec_offset(back) == 0) { return ESP_OK; }
+    if (variable_length) {
+        uint16_t len;
+        esp_err_t err = flash_read(data_offset + back, &len, LEN_SIZE);
+        if (err != ESP_OK || len == LEN_UNUSED) { return err; }
+        if (len > record_size || sec_space - sec_offset(back) < LEN_SIZE + len) { return ESP_OK; }
+        ++record_num;
+        back = next_record(back, len);
+        return write_header();
+    }
+    // only the part in the back sector is known to have been erased before the record was written
+    size_t len = sec_size - sec_offset(back) < frame_size ? sec_size - sec_offset(back) : frame_size;
+    void* next = malloc(len);
+    if (next == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = flash_read(data_offset + back, next, len);
+    if (err == ESP_OK && !is_all_ff(next, len)) {
+        ++record_num;
+        back = advance(back, 1);
+        err = write_header();
+    }
+    free(next);
+    return err;
+}
+
+/**
+ * Erases the back sector again if a write cut off before its header commit left bytes after the back,
+ * since the next records would be programmed over them; the records and footer of the sector are written back
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::repair_back() {
+    size_t offset = sec_offset(back);
+    if (offset == 0 || offset >= sec_space) { return ESP_OK; }
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    size_t sec = data_offset + back - offset;
+    esp_err_t err = flash_read(sec, sector, sec_size);
+    if (err == ESP_OK && !is_all_ff(sector + offset, sec_space - offset)) {
+        err = flash_erase(sec, sec_size);
+        if (err == ESP_OK) { err = flash_write(sec, sector, offset); }
+        if (err == ESP_OK && footer_size != 0 && !is_all_ff(sector + sec_space, footer_size)) {
+            err = flash_write(sec + sec_space, sector + sec_space, footer_size);
+        }
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Counts the records written after the back of the last header by checking their checksums
+ * Records left over from an earlier lap fail the check since it is seeded with the lap of their position
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::scan_records() {
+    size_t found = 0;
+    uint8_t* frame = frame_buf;
+    while (true) {
+        size_t pos = back;
+        size_t len = record_size;
+        if (variable_length) {
+            uint16_t prefix = LEN_UNUSED;
+            esp_err_t err = flash_read(data_offset + pos, &prefix, LEN_SIZE);
+            if (err != ESP_OK) { return err; }
+            if (prefix == LEN_UNUSED && sec_offset(pos) != 0) {
+                pos = next_sec(pos);
+                err = flash_read(data_offset + pos, &prefix, LEN_SIZE);
+                if (err != ESP_OK) { return err; }
+            }
+            if (prefix > record_size || sec_space - sec_offset(pos) < LEN_SIZE + prefix + TAG_SIZE) { break; }
+            len = prefix;
+        }
+        if (span_sectors ? free_records() == 0 :
+            record_num > 0 && sec_offset(pos) == 0 && sec_index(pos) == sec_index(front)) { break; }
+        if (sec_offset(pos) == 0) {
+            // a sealed sector was filled completely, its records are counted without reading them
+            uint32_t sealed;
+            esp_err_t err = read_seal(pos, &sealed);
+            if (err != ESP_OK) { return err; }
+            if (sealed != 0) {
+                back = next_sec(pos);
+                record_num += sealed;
+                found += sealed;
+                continue;
+            }
+        }
+        size_t frame_len = variable_length ? LEN_SIZE + len + TAG_SIZE : frame_size;
+        esp_err_t err = read_span(pos, frame, frame_len);
+        if (err != ESP_OK) { return err; }
+        bool valid = frame_valid(pos, frame, frame_len);
+        if (!valid) {
+            // past the back its sector is erased, unless the sector has not been entered yet
+            size_t in_sec = sec_size - sec_offset(pos) < frame_len ? sec_size - sec_offset(pos) : frame_len;
+            if (sec_offset(pos) == 0 || is_all_ff(frame, in_sec)) { break; }
+        }
+        // a torn record is kept since its space can't be written again, reading it reports ESP_ERR_INVALID_CRC
+        back = next_record(pos, len);
+        record_num++;
+        found++;
+        if (!valid) { break; }
+    }
+    return found > 0 ? write_header() : ESP_OK;
 }
 
 /**
@@ -57,165 +507,2191 @@ esp_err_t CircularBuffer::write_header() {
  * @return ESP_OK if ok
  */
 esp_err_t CircularBuffer::init(char* partition_name, size_t record_size, bool overwrite, bool recovery_mode) {
-    const esp_partition_t *partition = esp_partition_find_first(
-        ESP_PARTITION_TYPE_DATA,
-        ESP_PARTITION_SUBTYPE_ANY,
-        partition_name
-    );
-
-    if (partition == NULL) { return ESP_ERR_NOT_FOUND; }
+    cb_config config;
+    config.overwrite = overwrite;
+    config.recovery_mode = recovery_mode;
+    return init(partition_name, record_size, config);
+}
 
-    esp_err_t err = wl_mount(partition, &wl_handle);
+/**
+ * Initializes circular buffer
+ * @param partition_name name of partition in which circular buffer is going to be initialized
+ * @param record_size  size of every record in circular buffer
+ * @param config options of the circular buffer
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::init(char* partition_name, size_t record_size, const cb_config& config) {
+    // the flush task must not write while the partition is mounted again
+    stop_async();
+    cb_storage storage;
+    esp_err_t err = cb_storage_wl(partition_name, &storage);
     if (err != ESP_OK) { return err; }
+    return init(storage, record_size, config);
+}
+
+/**
+ * Initializes circular buffer
+ * @param storage flash holding the circular buffer, copied
+ * @param record_size  size of every record in circular buffer
+ * @param config options of the circular buffer
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::init(const cb_storage& storage, size_t record_size, const cb_config& config) {
+    stop_async();
+    // records accepted into the back sector cache of a previous init() are written to its storage first
+    esp_err_t flush_err = flush_pending();
+    if (flush_err != ESP_OK) { return flush_err; }
+    this->storage = storage;
+    mirrored = config.mirror != NULL;
+    if (mirrored) {
+        // the copies are reconciled by their headers, which must be stored in them
+        if (config.mirror->size != storage.size || config.mirror->sector_size != storage.sector_size) { return ESP_ERR_INVALID_SIZE; }
+        if (storage.store_header != NULL || config.mirror->store_header != NULL) { return ESP_ERR_INVALID_ARG; }
+        mirror_storage = *config.mirror;
+    }
 
-    size_t sec_size = wl_sector_size(wl_handle);
+    size_t tag_size = config.record_crc ? TAG_SIZE : 0;
+    // compressed records are stored in the variable length layout
+    bool length_prefixed = config.variable_length || config.compress_width != 0;
+    if (config.compress_width != 0 && ((config.compress_width != 1 && config.compress_width != 2 && config.compress_width != 4) ||
+        config.variable_length || record_size % config.compress_width != 0)) { return ESP_ERR_INVALID_ARG; }
+    if (config.span_sectors && length_prefixed) { return ESP_ERR_INVALID_ARG; }
+    size_t seal_size = config.seal_sectors ? SEAL_SIZE : 0;
+    if (config.span_sectors && config.seal_sectors) { return ESP_ERR_INVALID_ARG; }
+    if (!config.span_sectors && record_size + tag_size + seal_size > storage.sector_size) { return ESP_ERR_INVALID_SIZE; }
+    if (length_prefixed && (record_size + LEN_SIZE + tag_size + seal_size > storage.sector_size || record_size >= LEN_UNUSED)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (config.timestamp_size != 0 && ((config.timestamp_size != 4 && config.timestamp_size != 8) ||
+        length_prefixed || config.timestamp_size > record_size)) { return ESP_ERR_INVALID_ARG; }
+    if (config.aggregator != NULL && (length_prefixed || config.span_sectors)) { return ESP_ERR_INVALID_ARG; }
+    size_t footer_size = config.aggregator != NULL ? config.aggregator->size + TAG_SIZE : 0;
+    if (!config.span_sectors && record_size + tag_size + footer_size + seal_size > storage.sector_size) { return ESP_ERR_INVALID_SIZE; }
 
-    if (record_size > sec_size) { return ESP_ERR_INVALID_SIZE; }
+    free(back_cache);
+    free(front_cache);
+    free(frame_buf);
+    free(time_index);
+    free(back_state);
+    free(footer_buf);
+    free(pack_buf);
+    free(unpack_buf);
+    free(back_ref);
+    free(prev_ref);
+    free(last_ref);
+    free(mirror_buf);
+    back_cache = NULL;
+    front_cache = NULL;
+    frame_buf = NULL;
+    time_index = NULL;
+    back_state = NULL;
+    footer_buf = NULL;
+    pack_buf = unpack_buf = back_ref = prev_ref = last_ref = NULL;
+    mirror_buf = NULL;
+    back_cache_valid = false;
+    front_cache_valid = false;
+    pending_start = pending_end = 0;
 
     this->record_size = record_size;
-    this->overwrite = overwrite;
-
-    cb_header header1;
-    err = wl_read(wl_handle, 0, &header1, sizeof(cb_header));
-    if (err != ESP_OK) { return err; }
+    this->span_sectors = config.span_sectors;
+    this->record_crc = config.record_crc;
+    layout = (length_prefixed ? LAYOUT_LENGTH_PREFIX : 0) | (config.record_crc ? LAYOUT_CRC : 0) | (config.span_sectors ? LAYOUT_SPAN : 0) |
+             (config.seal_sectors ? LAYOUT_SEAL : 0) | config.compress_width << LAYOUT_COMPRESS_SHIFT;
+    frame_size = record_size + tag_size;
+    this->aggregator = config.aggregator;
+    this->footer_size = footer_size;
+    this->seal_size = seal_size;
+    load_geometry();
+    if (record_size == 0 || (span_sectors && frame_size + sec_size > ring_size)) { return ESP_ERR_INVALID_SIZE; }
+    this->overwrite = config.overwrite;
+    admit = config.admit;
+    admit_arg = config.admit_arg;
+    this->journal = config.journal && storage.store_header == NULL;
+    this->variable_length = length_prefixed;
+    compress_width = config.compress_width;
+    this->flush_records = config.flush_records;
+    this->flush_bytes = config.flush_bytes;
+    this->checkpoint_records = config.checkpoint_records;
+    this->checkpoint_ms = config.checkpoint_ms;
+    ahead_target = config.erase_ahead;
+    ahead_count = 0;
+    timestamp_size = config.timestamp_size;
+    pending_records = 0;
+    uncommitted = 0;
+    last_commit_ms = now_ms();
+    if (record_crc) {
+        // scratch space for assembling a frame or a sector of frames
+        scratch_size = LEN_SIZE + frame_size > sec_size ? LEN_SIZE + frame_size : sec_size;
+        frame_buf = (uint8_t*)malloc(scratch_size);
+        if (frame_buf == NULL) { return ESP_ERR_NO_MEM; }
+        if (mirrored) {
+            mirror_buf = (uint8_t*)malloc(LEN_SIZE + frame_size);
+            if (mirror_buf == NULL) { return ESP_ERR_NO_MEM; }
+        }
+    }
 
-    cb_header header2;
-    err = wl_read(wl_handle, secs_for_one_header() * sec_size, &header2, sizeof(cb_header));
+    esp_err_t err = reconcile();
     if (err != ESP_OK) { return err; }
-
-    bool header1_valid = check_header(&header1);
-    bool header2_valid = check_header(&header2);
-
-    if (header1_valid && header2_valid) {
-        if (header1.sequence > header2.sequence || (header1.sequence == 0 && header2.sequence == UINT32_MAX)) {
-            front = header1.front;
-            record_num = header1.record_num;
-            sequence = header1.sequence;
-        } else {
-            front = header2.front;
-            record_num = header2.record_num;
-            sequence = header2.sequence;
-        }
-    } else if (recovery_mode && (header1_valid ^ header2_valid)) {
-        if (header1_valid) {
-            front = header1.front;
-            record_num = header1.record_num;
-            sequence = header1.sequence;
-        } else {
-            front = header2.front;
-            record_num = header2.record_num;
-            sequence = header2.sequence;
+    cb_header headers[2];
+    bool found[2], torn[2];
+    size_t next_free[2] = {0, 0};
+    int newest = -1;
+    bool recover = false;
+    if (storage.load_header != NULL) {
+        // the storage replaces its header atomically, so there is no torn commit to recover from
+        err = storage.load_header(storage.ctx, &headers[0], sizeof(cb_header), &found[0]);
+        if (err != ESP_OK) { return err; }
+        if (found[0] && check_header(&headers[0])) { newest = 0; }
+    } else {
+        for (uint32_t slot = 0; slot < 2; slot++) {
+            err = read_header_slot(slot, &headers[slot], &found[slot], &torn[slot], &next_free[slot]);
+            if (err != ESP_OK) { return err; }
         }
-        size_t back = get_back();
-        if (back % sec_size != 0) {
-            void* next = malloc(record_size);
-            wl_read(wl_handle, header_offset() + back, next, record_size);
-            if (!is_all_ff(next, record_size)) {
-                ++record_num;
-                write_header();
+        if (journal) {
+            if (found[0] && found[1]) { newest = is_newer(headers[1].sequence, headers[0].sequence) ? 1 : 0; }
+            else if (found[0] || found[1]) { newest = found[0] ? 0 : 1; }
+            if (newest >= 0 && torn[newest]) {
+                if (config.recovery_mode) { recover = true; }
+                else { newest = -1; }
             }
-            free(next);
+        } else if (found[0] && found[1]) {
+            newest = is_newer(headers[1].sequence, headers[0].sequence) ? 1 : 0;
+        } else if (config.recovery_mode && (found[0] ^ found[1])) {
+            newest = found[0] ? 0 : 1;
+            recover = true;
         }
+    }
+
+    if (newest >= 0) {
+        err = check_layout(&headers[newest]);
+        if (err != ESP_OK) { return err; }
+        front = headers[newest].front;
+        record_num = headers[newest].record_num;
+        sequence = headers[newest].sequence;
+        front_lap = headers[newest].front_lap;
+        committed_front = front;
+        journal_slot = newest;
+        journal_pos = next_free[newest];
+        if (variable_length) { err = walk_back(); }
+        else { back = get_back(); }
+        if (err == ESP_OK && record_crc) { err = scan_records(); }
+        else if (err == ESP_OK && recover) { err = recover_next_record(); }
+        if (err == ESP_OK) { err = repair_back(); }
     } else {
         front = 0;
+        back = 0;
         record_num = 0;
         sequence = -1;
-        write_header();
+        front_lap = 0;
+        committed_front = 0;
+        if (journal) {
+            // stale entries in either slot could outrank the fresh header
+            err = flash_erase(0, 2 * slot_size);
+            if (err != ESP_OK) { return err; }
+            journal_slot = 0;
+            journal_pos = 0;
+        }
+        err = write_header();
     }
+    if (err == ESP_OK) { err = count_back_records(); }
+    if (err == ESP_OK) { err = build_time_index(); }
+    if (err == ESP_OK) { err = load_back_state(); }
+    if (err == ESP_OK) { err = load_refs(); }
+    if (err != ESP_OK) { return err; }
+    committed_front = front;
 
-    return ESP_OK;
+    api_lock = front_lock = commit_lock = NULL;
+    if (config.locking == CB_LOCK_MUTEX) {
+        if (!api_mutex.init()) { return ESP_ERR_NO_MEM; }
+        api_lock = &api_mutex;
+    } else if (config.locking == CB_LOCK_SPSC || config.async_records != 0) {
+        if (!front_mutex.init() || !commit_mutex.init()) { return ESP_ERR_NO_MEM; }
+        front_lock = &front_mutex;
+        commit_lock = &commit_mutex;
+    }
+#ifdef CB_STATS
+    if (commit_lock != NULL && !stats_mutex.init()) { return ESP_ERR_NO_MEM; }
+    stats_lock = commit_lock != NULL ? &stats_mutex : NULL;
+#endif
+    err = init_cache(config);
+    if (err != ESP_OK) { return err; }
+    return start_async(config);
 }
 
 /**
- * Pushes data to the back of circular buffer
- * @param src source of data
+ * Allocates the sector caches requested by config and loads the partially written back sector
  * @return ESP_OK if ok
  */
-esp_err_t CircularBuffer::push_back (void* src) {
-    size_t sec_size = wl_sector_size(wl_handle);
-    size_t back;
-    uint32_t remaining_capacity_in_front_sector = (sec_size - (front % sec_size)) / record_size;
-    if (remaining_capacity_in_front_sector > record_num) { back = front + (record_num * record_size); }
-    else {
-        uint32_t remaining_records = record_num - remaining_capacity_in_front_sector;
-        uint32_t full_secs = remaining_records / records_in_sec();
-        uint32_t front_sec = front / sec_size;
-        uint32_t back_sec = (front_sec + full_secs + 1) % sec_num();
-        if (back_sec == front_sec) {
-            if (overwrite) {
-                front = ((front_sec + 1) % sec_num()) * sec_size;
-                record_num -= remaining_capacity_in_front_sector;
-            }
-            else { return ESP_ERR_NO_MEM; }
-        }
-        size_t back_offset_in_sec = (remaining_records % records_in_sec()) * record_size;
-        back = back_sec * sec_size + back_offset_in_sec;
+esp_err_t CircularBuffer::init_cache(const cb_config& config) {
+    if (config.cache_front) {
+        front_cache = (uint8_t*)malloc(sec_size);
+        if (front_cache == NULL) { return ESP_ERR_NO_MEM; }
     }
-    if (back % sec_size == 0) { wl_erase_range(wl_handle, back + header_offset(), sec_size); }
-    esp_err_t err = wl_write(wl_handle, back + header_offset(), src, record_size); 
+    if (!config.cache_back) { return ESP_OK; }
+    back_cache = (uint8_t*)malloc(sec_size);
+    if (back_cache == NULL) { return ESP_ERR_NO_MEM; }
+    if (sec_offset(back) == 0) { return ESP_OK; }
+    back_cache_sec = back - sec_offset(back);
+    pending_start = pending_end = sec_offset(back);
+    back_cache_valid = true;
+    return flash_read(data_offset + back_cache_sec, back_cache, sec_size);
+}
+
+CircularBuffer::~CircularBuffer() {
+    stop_async();
+    flush_pending();
+    free(back_cache);
+    free(front_cache);
+    free(frame_buf);
+    free(time_index);
+    free(back_state);
+    free(footer_buf);
+    free(pack_buf);
+    free(unpack_buf);
+    free(back_ref);
+    free(prev_ref);
+    free(last_ref);
+    free(mirror_buf);
+}
+
+/**
+ * Writes the records pending in the back sector cache to flash, without committing the header
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::flush_cache() {
+    if (back_cache == NULL || pending_end == pending_start) { return ESP_OK; }
+    esp_err_t err = flash_write(data_offset + back_cache_sec + pending_start, back_cache + pending_start, pending_end - pending_start);
     if (err != ESP_OK) { return err; }
-    record_num++;
+    pending_start = pending_end;
+    pending_records = 0;
+    return ESP_OK;
+}
+
+/**
+ * Writes the records still pending in the back sector cache before it is freed, committing the header if it is due
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::flush_pending() {
+    if (back_cache == NULL) { return ESP_OK; }
+    esp_err_t err = flush();
+    if (err != ESP_OK) { return err; }
+    CbGuard commit_guard(commit_lock);
+    return flush_cache();
+}
+
+/**
+ * Writes pending records and commits the header
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::flush() {
+    CbGuard api_guard(api_lock);
+    CbGuard commit_guard(commit_lock);
+    if (!header_dirty) { return ESP_OK; }
     return write_header();
 }
 
 /**
- * Retrieves data from the front of the circular buffer
- * @param dest destination of data
+ * Writes records at the back of the circular buffer, into the back sector cache if it is enabled
+ * @param pos position relative to the data area, the records must lie in one sector
  * @return ESP_OK if ok
  */
-esp_err_t CircularBuffer::peek_front (void* dest) {
-    if (record_num == 0) { return ESP_ERR_NOT_FOUND; }
-    return wl_read(wl_handle, front + header_offset(), dest, record_size);
+esp_err_t CircularBuffer::write_data(size_t pos, const void* src, size_t len) {
+    if (back_cache == NULL) { return flash_write(data_offset + pos, src, len); }
+    CbGuard commit_guard(commit_lock);
+    size_t sec = pos - sec_offset(pos);
+    if (!back_cache_valid || sec != back_cache_sec) {
+        // moving on to a freshly erased sector
+        esp_err_t err = flush_cache();
+        if (err != ESP_OK) { return err; }
+        memset(back_cache, 0xFF, sec_size);
+        back_cache_sec = sec;
+        pending_start = pending_end = 0;
+        back_cache_valid = true;
+    }
+    memcpy(back_cache + sec_offset(pos), src, len);
+    // a length prefix lands before bytes that a commit from the consumer may already have flushed
+    if (pending_end == pending_start || sec_offset(pos) < pending_start) { pending_start = sec_offset(pos); }
+    if (sec_offset(pos) + len > pending_end) { pending_end = sec_offset(pos) + len; }
+    return ESP_OK;
 }
 
 /**
- * Retrieves data from the front of the circular buffer and deletes it
- * @param dest destination of data
+ * Writes data that may cross sector boundaries, one write per sector
+ * @param pos position relative to the data area
  * @return ESP_OK if ok
  */
-esp_err_t CircularBuffer::pop_front (void* dest) {
-    esp_err_t err = peek_front(dest);
-    if (err != ESP_OK) { return err; }
-    return delete_front();
+esp_err_t CircularBuffer::write_span(size_t pos, const void* src, size_t len) {
+    const uint8_t* data = (const uint8_t*)src;
+    while (len > 0) {
+        size_t chunk = sec_size - sec_offset(pos);
+        if (chunk > len) { chunk = len; }
+        esp_err_t err = write_data(pos, data, chunk);
+        if (err != ESP_OK) { return err; }
+        pos = ring_add(pos, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
 }
 
 /**
- * @return Number of records currently in the circular buffer
+ * Reads data that may cross sector boundaries, one read per sector
+ * @param pos position relative to the data area
+ * @return ESP_OK if ok
  */
-uint32_t CircularBuffer::get_record_num() { return record_num; }
+esp_err_t CircularBuffer::read_span(size_t pos, void* dest, size_t len) {
+    uint8_t* data = (uint8_t*)dest;
+    while (len > 0) {
+        size_t chunk = sec_size - sec_offset(pos);
+        if (chunk > len) { chunk = len; }
+        esp_err_t err = read_data(pos, data, chunk);
+        if (err != ESP_OK) { return err; }
+        pos = ring_add(pos, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
 
 /**
- * Deletes one record from the front of the circular buffer
+ * Reads records, from a sector cache if one holds their sector
+ * @param pos position relative to the data area, the records must lie in one sector
  * @return ESP_OK if ok
  */
-esp_err_t CircularBuffer::delete_front() {
-    size_t sec_size = wl_sector_size(wl_handle);
-    if (sec_size - (front % sec_size) >= 2 * record_size) { front += record_size; }
-    else { front = ((front / sec_size) + 1) % sec_num() * sec_size; }
-    record_num--;
-    return write_header();
+esp_err_t CircularBuffer::read_data(size_t pos, void* dest, size_t len) {
+    if (back_cache != NULL) {
+        CbGuard commit_guard(commit_lock);
+        if (back_cache_valid && pos - sec_offset(pos) == back_cache_sec) {
+            memcpy(dest, back_cache + sec_offset(pos), len);
+            return ESP_OK;
+        }
+    }
+    const void* src;
+    esp_err_t err = front_cached(pos, &src);
+    if (err == ESP_OK) {
+        memcpy(dest, src, len);
+        return ESP_OK;
+    }
+    if (err != ESP_ERR_NOT_SUPPORTED) { return err; }
+    return flash_read(data_offset + pos, dest, len);
+}
+
+/**
+ * Finds a position in the sector caches, loading its sector into the front cache if that is enabled
+ * In CB_LOCK_SPSC mode a pointer into the back sector cache would race with the producer and is not given out,
+ * other sectors are found in the mapping of the storage if it is mapped
+ * @param pos position relative to the data area
+ * @param src pointer to the cached data
+ * @return ESP_OK if ok, ESP_ERR_NOT_SUPPORTED if no cache can hold the position
+ */
+esp_err_t CircularBuffer::cached_data(size_t pos, const void** src) {
+    {
+        CbGuard commit_guard(commit_lock);
+        if (back_cache_valid && pos - sec_offset(pos) == back_cache_sec) {
+            if (commit_lock != NULL) { return ESP_ERR_NOT_SUPPORTED; }
+            *src = back_cache + sec_offset(pos);
+            return ESP_OK;
+        }
+    }
+    if (storage.mapped != NULL) {
+        *src = storage.mapped + data_offset + pos;
+        return ESP_OK;
+    }
+    return front_cached(pos, src);
+}
+
+/**
+ * Finds a position in the front sector cache, loading its sector if needed
+ * The back sector is never loaded into the front cache while records are still written to it
+ * @return ESP_OK if ok, ESP_ERR_NOT_SUPPORTED if the front cache can't hold the position
+ */
+esp_err_t CircularBuffer::front_cached(size_t pos, const void** src) {
+    size_t sec = pos - sec_offset(pos);
+    if (front_cache == NULL) { return ESP_ERR_NOT_SUPPORTED; }
+    if (back_cache == NULL) {
+        CbGuard commit_guard(commit_lock);
+        if (sec_offset(back) != 0 && sec == back - sec_offset(back)) { return ESP_ERR_NOT_SUPPORTED; }
+    }
+    if (!front_cache_valid || front_cache_sec != sec) {
+        front_cache_valid = false;
+        esp_err_t err = flash_read(data_offset + sec, front_cache, sec_size);
+        if (err != ESP_OK) { return err; }
+        front_cache_sec = sec;
+        front_cache_valid = true;
+    }
+    *src = front_cache + sec_offset(pos);
+    return ESP_OK;
+}
+
+/**
+ * Asks the admit callback whether a record may drop records from the front
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the record is rejected
+ */
+esp_err_t CircularBuffer::admitted(const void* record, size_t len) {
+    if (admit == NULL || admit(record, len, admit_arg)) { return ESP_OK; }
+    CB_STAT(stats.rejected++);
+    return ESP_ERR_NO_MEM;
+}
+
+/**
+ * Prepares the sector at the back of the circular buffer before the first record is written to it,
+ * dropping the front sector in overwrite mode if the buffer is full
+ * @param record record about to be written, passed to the admit callback before records are dropped for it
+ * @param len length of the record
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the buffer is full and overwrite is off or the record is rejected
+ */
+esp_err_t CircularBuffer::reserve_back(const void* record, size_t len) {
+    if (span_sectors) { return reserve_span(frame_size, record, len); }
+    if (sec_offset(back) != 0) { return ESP_OK; }
+    {
+        // dropping records moves the front, so the consumer has to be idle
+        CbGuard front_guard(overwrite ? front_lock : NULL);
+        CbGuard commit_guard(commit_lock);
+        if (record_num > 0 && sec_index(back) == sec_index(front)) {
+            if (!overwrite) { return ESP_ERR_NO_MEM; }
+            esp_err_t err = admitted(record, len);
+            if (err != ESP_OK) { return err; }
+            size_t dropped = variable_length ? records_to_sec_end(front) : sec_records - sec_offset(front) / frame_size;
+            CB_STAT(stats.dropped += dropped < record_num ? dropped : record_num);
+            record_num -= dropped < record_num ? dropped : record_num;
+            set_front(next_sec(front));
+        }
+    }
+    return prepare_sec(back);
+}
+
+/**
+ * Erases a data sector before records are written to it
+ * @param sec start of the sector relative to the data area
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::erase_sec(size_t sec) {
+    {
+        CbGuard commit_guard(commit_lock);
+        if (front != committed_front) {
+            // the committed header must not refer to a sector that is about to be erased
+            esp_err_t err = write_header();
+            if (err != ESP_OK) { return err; }
+        }
+    }
+    return flash_erase(data_offset + sec, sec_size);
+}
+
+/**
+ * Makes a data sector ready for the first record written to it, skipping the erase if it was erased ahead
+ * @param sec start of the sector relative to the data area
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::prepare_sec(size_t sec) {
+    if (time_index != NULL) {
+        CbGuard commit_guard(commit_lock);
+        time_index[sec_index(sec)].count = 0;
+    }
+    if (ahead_count > 0 && sec == ahead_start) {
+        ahead_start = next_sec(sec);
+        ahead_count--;
+        return ESP_OK;
+    }
+    ahead_count = 0;
+    return erase_sec(sec);
+}
+
+/**
+ * Erases free sectors past the back of the circular buffer until erase_ahead of them are ready
+ * Meant for an idle producer, in CB_LOCK_SPSC mode it must be called by the task that pushes
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::erase_ahead() {
+    CbGuard api_guard(api_lock);
+    while (ahead_count < ahead_target && ahead_count + 1 < sec_count) {
+        size_t sec;
+        {
+            CbGuard commit_guard(commit_lock);
+            if (ahead_count == 0) { ahead_start = sec_offset(back) == 0 ? back : next_sec(back); }
+            sec = ring_add(ahead_start, ahead_count * sec_size);
+            // the sector of the front holds records, unless the buffer is empty and the back has not entered it yet
+            if (sec_index(sec) == sec_index(front) && !(record_num == 0 && sec == back)) { break; }
+        }
+        esp_err_t err = erase_sec(sec);
+        if (err != ESP_OK) { return err; }
+        ahead_count++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Moves the front of the circular buffer forward, counting its laps around the data area
+ * Moving it to where it already is skips a full buffer, which is a whole lap
+ */
+void CircularBuffer::set_front(size_t pos) {
+    CbGuard commit_guard(commit_lock);
+    bool lap = pos <= front;
+    if (lap) { front_lap++; }
+    front = pos;
+    // a decoded record only continues an encoding if it was written in the same lap
+    if (lap) { prev_valid = last_valid = false; }
+    // a sector is only erased after the front left it or skipped a whole lap, which makes its cached copy stale
+    if (front_cache_valid && (lap || pos - sec_offset(pos) != front_cache_sec)) { front_cache_valid = false; }
 }
 
-size_t CircularBuffer::records_in_sec() { return wl_sector_size(wl_handle) / record_size; }
+/**
+ * @return Lap of a record at pos between front and back, records behind the front are one lap ahead of it
+ */
+uint32_t CircularBuffer::lap_of(size_t pos) { return pos < front ? front_lap + 1 : front_lap; }
+
+/**
+ * Checks the checksum of the record at pos whose data has been read to data
+ * @param len length of the record
+ * @return ESP_OK if ok, ESP_ERR_INVALID_CRC if the record is corrupted
+ */
+esp_err_t CircularBuffer::check_record(size_t pos, const void* data, size_t len) {
+    if (!record_crc) { return ESP_OK; }
+    uint32_t tag;
+    esp_err_t err = read_span(ring_add(payload(pos), len), &tag, TAG_SIZE);
+    if (err != ESP_OK) { return err; }
+    uint32_t crc = lap_of(pos);
+    if (variable_length) {
+        uint16_t prefix = len;
+        crc = cb_crc32(crc, (const uint8_t*)&prefix, LEN_SIZE);
+    }
+    crc = cb_crc32(crc, (const uint8_t*)data, len);
+    return crc == tag ? ESP_OK : ESP_ERR_INVALID_CRC;
+}
 
 /**
- * @return Capacity of the circular buffer
+ * Checks the checksum of a whole frame as it is stored
+ * @param pos position of the frame
+ * @param len length of the frame including its checksum
+ * @return Whether the frame is intact
  */
+bool CircularBuffer::frame_valid(size_t pos, const uint8_t* frame, size_t len) {
+    uint32_t tag;
+    memcpy(&tag, frame + len - TAG_SIZE, TAG_SIZE);
+    return cb_crc32(lap_of(pos), frame, len - TAG_SIZE) == tag;
+}
 
-size_t CircularBuffer::get_max_records() { return sec_num() * records_in_sec(); }
+/**
+ * Reads a frame from the mirror, for a frame whose copy in the storage is corrupted
+ * @param pos position of the frame
+ * @param frame destination of the frame
+ * @param len length of the frame including its checksum
+ * @return Whether frame holds an intact copy
+ */
+bool CircularBuffer::mirror_frame(size_t pos, uint8_t* frame, size_t len) {
+    if (!mirrored) { return false; }
+    for (size_t done = 0, at = pos; done < len;) {
+        size_t chunk = sec_size - sec_offset(at);
+        if (chunk > len - done) { chunk = len - done; }
+        if (mirror_storage.read(mirror_storage.ctx, data_offset + at, frame + done, chunk) != ESP_OK) { return false; }
+        at = ring_add(at, chunk);
+        done += chunk;
+    }
+    return frame_valid(pos, frame, len);
+}
 
-uint32_t CircularBuffer::sec_num() { return wl_size(wl_handle) / wl_sector_size(wl_handle) - secs_for_header(); }
+/**
+ * Checks the checksum of the record at pos like check_record(), replacing a corrupted record by its copy in the mirror
+ * @param data data of the record, read from the storage
+ * @param len length of the record
+ * @return ESP_OK if ok, ESP_ERR_INVALID_CRC if no copy of the record is intact
+ */
+esp_err_t CircularBuffer::check_mirrored(size_t pos, void* data, size_t len) {
+    esp_err_t err = check_record(pos, data, len);
+    if (err != ESP_ERR_INVALID_CRC || mirror_buf == NULL) { return err; }
+    size_t head = payload(pos) - pos;
+    if (!mirror_frame(pos, mirror_buf, head + len + TAG_SIZE)) { return err; }
+    memcpy(data, mirror_buf + head, len);
+    return ESP_OK;
+}
 
-size_t CircularBuffer::get_back() {
-    size_t sec_size = wl_sector_size(wl_handle);
-    uint32_t remaining_capacity_in_front_sector = (sec_size - (front % sec_size)) / record_size;
-    if (remaining_capacity_in_front_sector > record_num) { return front + (record_num * record_size); }
+/**
+ * Lays out a record as it is stored: length prefix in variable length mode, data and checksum
+ * @param frame destination, room for the whole frame
+ * @param seed lap in which the record is written
+ * @return Size of the frame
+ */
+size_t CircularBuffer::build_frame(uint8_t* frame, const void* src, size_t len, uint32_t seed) {
+    size_t head = 0;
+    if (variable_length) {
+        uint16_t prefix = len;
+        memcpy(frame, &prefix, LEN_SIZE);
+        head = LEN_SIZE;
+    }
+    memcpy(frame + head, src, len);
+    uint32_t crc = cb_crc32(seed, frame, head + len);
+    memcpy(frame + head + len, &crc, TAG_SIZE);
+    return head + len + TAG_SIZE;
+}
+
+/**
+ * @return Whether len is a valid length for a record pushed by the caller
+ */
+bool CircularBuffer::len_ok(size_t len) { return variable_length && compress_width == 0 ? len <= record_size : len == record_size; }
+
+/**
+ * Encodes a record as the zig-zag varint deltas of its words against a reference record
+ * @param src record of record_size bytes
+ * @param ref previous record of the sector, NULL for the first record of a sector
+ * @param dest destination, room for record_size bytes
+ * @return Length of the encoding, record_size if the record is stored as it is
+ */
+size_t CircularBuffer::pack(const uint8_t* src, const uint8_t* ref, uint8_t* dest) {
+    size_t len = 0;
+    uint32_t shift = 32 - 8 * compress_width;
+    for (size_t i = 0; i < record_size; i += compress_width) {
+        uint32_t word = 0, base = 0;
+        memcpy(&word, src + i, compress_width);
+        if (ref != NULL) { memcpy(&base, ref + i, compress_width); }
+        // the difference wraps at the width of a word, sign extended it is small for values moving either way
+        int32_t delta = (int32_t)((word - base) << shift) >> shift;
+        uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+        do {
+            if (len + 1 >= record_size) {
+                memcpy(dest, src, record_size);
+                return record_size;
+            }
+            dest[len++] = (zigzag & 0x7F) | (zigzag > 0x7F ? 0x80 : 0);
+            zigzag >>= 7;
+        } while (zigzag != 0);
+    }
+    return len;
+}
+
+/**
+ * Decodes a record encoded by pack()
+ * @param src encoding
+ * @param len length of the encoding
+ * @param ref previous record of the sector, NULL for the first record of a sector
+ * @param dest destination, room for record_size bytes, must not overlap ref
+ * @return Whether the encoding is well formed
+ */
+bool CircularBuffer::unpack(const uint8_t* src, size_t len, const uint8_t* ref, uint8_t* dest) {
+    if (len == record_size) {
+        memcpy(dest, src, record_size);
+        return true;
+    }
+    size_t in = 0;
+    for (size_t i = 0; i < record_size; i += compress_width) {
+        uint32_t zigzag = 0;
+        for (uint32_t shift = 0;; shift += 7) {
+            if (in == len || shift > 28) { return false; }
+            uint8_t byte = src[in++];
+            zigzag |= (uint32_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) { break; }
+        }
+        uint32_t word = 0;
+        if (ref != NULL) { memcpy(&word, ref + i, compress_width); }
+        word += (zigzag >> 1) ^ (0 - (zigzag & 1));
+        memcpy(dest + i, &word, compress_width);
+    }
+    return in == len;
+}
+
+/**
+ * Accounts for records written at the back, committing the header when it is due
+ * Called with commit_lock held
+ * @param count number of records
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::pushed(size_t count) {
+    header_dirty = true;
+    uncommitted += count;
+    bool flush_due = back_cache != NULL && ((flush_records != 0 && pending_records >= flush_records) ||
+        (flush_bytes != 0 && pending_end - pending_start >= flush_bytes));
+    if (!record_crc) { return back_cache == NULL || flush_due ? write_header() : ESP_OK; }
+    if (flush_due) {
+        esp_err_t err = flush_cache();
+        if (err != ESP_OK) { return err; }
+    }
+    return checkpoint_due() ? write_header() : ESP_OK;
+}
+
+/**
+ * Accounts for records deleted from the front, committing the header when it is due
+ * Called with commit_lock held
+ * @param count number of records
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::deleted(size_t count) {
+    CB_STAT(stats.pops += count);
+    if (!record_crc) { return write_header(); }
+    header_dirty = true;
+    uncommitted += count;
+    return checkpoint_due() ? write_header() : ESP_OK;
+}
+
+/**
+ * @return Whether the header should be committed under the checkpoint policy of record_crc mode
+ */
+bool CircularBuffer::checkpoint_due() {
+    if (checkpoint_records == 0 && checkpoint_ms == 0) { return true; }
+    if (checkpoint_records != 0 && uncommitted >= checkpoint_records) { return true; }
+    return checkpoint_ms != 0 && now_ms() - last_commit_ms >= checkpoint_ms;
+}
+
+/**
+ * Prepares every sector the next len bytes at the back of the circular buffer enter when records may
+ * cross sector boundaries, dropping the records at the front in overwrite mode if the buffer is full
+ * @param len number of bytes about to be written
+ * @param record first record about to be written, passed to the admit callback before records are dropped for it
+ * @param record_len length of the record
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the buffer is full and overwrite is off or the record is rejected
+ */
+esp_err_t CircularBuffer::reserve_span(size_t len, const void* record, size_t record_len) {
+    size_t dist = sec_offset(back) == 0 ? 0 : sec_size - sec_offset(back);
+    if (dist >= len) { return ESP_OK; }
+    size_t first = ring_add(back, dist);
+    size_t count = (len - dist - 1) / sec_size + 1;
+    {
+        CbGuard front_guard(overwrite ? front_lock : NULL);
+        CbGuard commit_guard(commit_lock);
+        if (!overwrite && record_num > 0) {
+            size_t sec = first;
+            for (size_t i = 0; i < count; i++, sec = next_sec(sec)) {
+                if (sec_index(sec) == sec_index(front)) { return ESP_ERR_NO_MEM; }
+            }
+        }
+        size_t sec = first;
+        for (size_t i = 0; overwrite && admit != NULL && i < count; i++, sec = next_sec(sec)) {
+            if (record_num > 0 && sec_index(sec) == sec_index(front)) {
+                esp_err_t err = admitted(record, record_len);
+                if (err != ESP_OK) { return err; }
+                break;
+            }
+        }
+        sec = first;
+        for (size_t i = 0; overwrite && i < count; i++, sec = next_sec(sec)) {
+            if (record_num > 0 && sec_index(sec) == sec_index(front)) {
+                // every record starting before the end of this sector loses data
+                size_t dropped = (sec + sec_size - front + frame_size - 1) / frame_size;
+                CB_STAT(stats.dropped += dropped < record_num ? dropped : record_num);
+                if (dropped >= record_num) {
+                    record_num = 0;
+                    set_front(back);
+                } else {
+                    record_num -= dropped;
+                    set_front(ring_add(front, dropped * frame_size));
+                }
+            }
+        }
+    }
+    size_t sec = first;
+    for (size_t i = 0; i < count; i++, sec = next_sec(sec)) {
+        esp_err_t err = prepare_sec(sec);
+        if (err != ESP_OK) { return err; }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Moves a position past count records, which must all lie in the sector of the position unless records span sectors
+ * @return Position of the record after them
+ */
+size_t CircularBuffer::advance(size_t pos, size_t count) {
+    if (span_sectors) { return ring_add(pos, count * frame_size); }
+    size_t end = sec_offset(pos) + count * frame_size;
+    if (sec_space - end < frame_size) { return next_sec(pos); }
+    return pos + count * frame_size;
+}
+
+/**
+ * Moves a position past one record
+ * In variable length mode the position moves to the next sector once no length prefix fits in the current one
+ * @param len length of the record
+ * @return Position of the record after it
+ */
+size_t CircularBuffer::next_record(size_t pos, size_t len) {
+    if (!variable_length) { return advance(pos, 1); }
+    size_t frame = LEN_SIZE + len + frame_size - record_size;
+    size_t end = sec_offset(pos) + frame;
+    if (sec_space - end < LEN_SIZE) { return next_sec(pos); }
+    return pos + frame;
+}
+
+/**
+ * @return Position of the data of the record at pos
+ */
+size_t CircularBuffer::payload(size_t pos) { return variable_length ? pos + LEN_SIZE : pos; }
+
+/**
+ * Finds the record at a position, in variable length mode skipping the unused end of a sector
+ * @param pos position of the record, moved to the next sector if the end of its sector is unused
+ * @param len length of the record
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::record_at(size_t* pos, size_t* len) {
+    if (!variable_length) {
+        *len = record_size;
+        return ESP_OK;
+    }
+    uint16_t prefix;
+    esp_err_t err = read_data(*pos, &prefix, LEN_SIZE);
+    if (err != ESP_OK) { return err; }
+    if (prefix == LEN_UNUSED) {
+        *pos = next_sec(*pos);
+        err = read_data(*pos, &prefix, LEN_SIZE);
+        if (err != ESP_OK) { return err; }
+    }
+    if (prefix > record_size) { return ESP_ERR_INVALID_STATE; }
+    *len = prefix;
+    return ESP_OK;
+}
+
+/**
+ * Counts the records from a position to the end of its sector in variable length mode
+ * @return Number of records
+ */
+size_t CircularBuffer::records_to_sec_end(size_t pos) {
+    size_t sec = sec_index(pos);
+    size_t count = 0;
+    while (count < record_num && sec_index(pos) == sec) {
+        uint16_t prefix;
+        if (read_data(pos, &prefix, LEN_SIZE) != ESP_OK || prefix == LEN_UNUSED) { break; }
+        count++;
+        pos = next_record(pos, prefix);
+    }
+    return count;
+}
+
+/**
+ * Derives the back of the circular buffer in variable length mode by walking the records from front,
+ * reading each sector once
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::walk_back() {
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = ESP_OK;
+    size_t loaded = SIZE_MAX;
+    size_t pos = front;
+    size_t count = 0;
+    while (count < record_num) {
+        size_t sec = pos - sec_offset(pos);
+        if (sec_offset(pos) == 0) {
+            // a sealed sector holding no more records than are left is skipped with one small read
+            uint32_t sealed;
+            err = read_seal(sec, &sealed);
+            if (err != ESP_OK) { break; }
+            if (sealed != 0 && sealed <= record_num - count) {
+                count += sealed;
+                pos = next_sec(pos);
+                continue;
+            }
+        }
+        if (sec != loaded) {
+            err = flash_read(data_offset + sec, sector, sec_size);
+            if (err != ESP_OK) { break; }
+            loaded = sec;
+        }
+        uint16_t prefix;
+        memcpy(&prefix, sector + sec_offset(pos), LEN_SIZE);
+        if (prefix == LEN_UNUSED) {
+            if (sec_offset(pos) == 0) {
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            pos = next_sec(pos);
+            continue;
+        }
+        if (prefix > record_size) {
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        pos = next_record(pos, prefix);
+        count++;
+    }
+    free(sector);
+    back = pos;
+    return err;
+}
+
+/**
+ * @return Number of records that can be pushed before the circular buffer is full
+ */
+size_t CircularBuffer::free_records() {
+    if (span_sectors) {
+        // the back may run up to the start of the sector holding the front
+        size_t limit = front - sec_offset(front);
+        size_t room = limit >= back ? limit - back : limit + ring_size - back;
+        if (room == 0 && record_num == 0) { room = ring_size; }
+        return room / frame_size;
+    }
+    return get_max_records() - sec_offset(front) / frame_size - record_num;
+}
+
+/**
+ * Pushes data to the back of circular buffer
+ * @param src source of data
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::push_back (void* src) { return push_back(src, record_size); }
+
+/**
+ * Pushes data to the back of circular buffer
+ * In CB_LOCK_SPSC mode the record is written without holding a lock and published under commit_lock
+ * @param src source of data
+ * @param len length of data, at most record_size in variable length mode and exactly record_size otherwise
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the buffer is full and overwrite is off or the admit callback rejects the record
+ */
+
+esp_err_t CircularBuffer::push_back(const void* src, size_t len) {
+    CbGuard api_guard(api_lock);
+    if (!len_ok(len)) { return ESP_ERR_INVALID_SIZE; }
+    esp_err_t err = check_times(src, 1);
+    if (err != ESP_OK) { return err; }
+    const void* record = src;
+    size_t record_len = len;
+    if (compress_width != 0) {
+        len = pack((const uint8_t*)record, sec_offset(back) == 0 ? NULL : back_ref, pack_buf);
+        src = pack_buf;
+    }
+    if (variable_length && sec_offset(back) != 0 && sec_space - sec_offset(back) < LEN_SIZE + len + frame_size - record_size) {
+        err = seal_sec(back - sec_offset(back));
+        if (err != ESP_OK) { return err; }
+        {
+            CbGuard commit_guard(commit_lock);
+            back = next_sec(back);
+        }
+        // the first record of a sector is encoded on its own
+        if (compress_width != 0) { len = pack((const uint8_t*)record, NULL, pack_buf); }
+    }
+    err = reserve_back(record, record_len);
+    if (err != ESP_OK) { return err; }
+    if (record_crc) {
+        uint32_t seed;
+        {
+            CbGuard commit_guard(commit_lock);
+            seed = lap_of(back);
+        }
+        // the checksum is the commit marker of the frame, which is written at once
+        err = write_span(back, frame_buf, build_frame(frame_buf, src, len, seed));
+        if (err != ESP_OK) { return err; }
+    } else {
+        err = write_span(payload(back), src, len);
+        if (err != ESP_OK) { return err; }
+    }
+    if (variable_length && !record_crc) {
+        // the length is written last so an interrupted record still reads as unused
+        uint16_t prefix = len;
+        err = write_data(back, &prefix, LEN_SIZE);
+        if (err != ESP_OK) { return err; }
+    }
+    err = fold_back(back, src, 1);
+    if (err != ESP_OK) { return err; }
+    back_sec_records++;
+    if (seal_size != 0 && sec_offset(next_record(back, len)) == 0) {
+        err = seal_sec(back - sec_offset(back));
+        if (err != ESP_OK) { return err; }
+    }
+    if (compress_width != 0) { memcpy(back_ref, record, record_size); }
+    CbGuard commit_guard(commit_lock);
+    index_time(back, src);
+    back = next_record(back, len);
+    record_num++;
+    CB_STAT(stats.pushes++);
+    if (back_cache != NULL) { pending_records++; }
+    return pushed(1);
+}
+
+/**
+ * Pushes multiple records to the back of circular buffer with a single header commit
+ * Records are written with one write per sector they occupy
+ * @param src source of data, count records laid out back to back
+ * @param count number of records
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if not all records fit and overwrite is off (nothing is pushed) or a record is
+ * rejected by the admit callback (the records before it are pushed)
+ */
+esp_err_t CircularBuffer::push_back_n(const void* src, size_t count) {
+    CbGuard api_guard(api_lock);
+    if (variable_length) { return ESP_ERR_NOT_SUPPORTED; }
+    {
+        CbGuard commit_guard(commit_lock);
+        if (!overwrite && count > free_records()) { return ESP_ERR_NO_MEM; }
+    }
+    esp_err_t err = check_times(src, count);
+    if (err != ESP_OK) { return err; }
+    const uint8_t* data = (const uint8_t*)src;
+    size_t done = 0;
+    while (done < count) {
+        size_t run = count - done;
+        if (record_crc && run > scratch_size / frame_size) { run = scratch_size / frame_size; }
+        // with overwrite a batch larger than the ring is written in runs that leave the back sector alone
+        if (span_sectors && run > (ring_size - sec_size) / frame_size) { run = (ring_size - sec_size) / frame_size; }
+        if (span_sectors && admit != NULL) {
+            // a run ends with the record entering the next sector, so that record is the one the admit callback sees
+            size_t fit = (sec_offset(back) == 0 ? 0 : sec_size - sec_offset(back)) / frame_size;
+            if (run > (fit != 0 ? fit : 1)) { run = fit != 0 ? fit : 1; }
+        }
+        const uint8_t* first = data + done * record_size;
+        if (span_sectors) { err = reserve_span(run * frame_size, first, record_size); }
+        else {
+            err = reserve_back(first, record_size);
+            if ((sec_space - sec_offset(back)) / frame_size < run) { run = (sec_space - sec_offset(back)) / frame_size; }
+        }
+        if (err != ESP_OK) { break; }
+        const uint8_t* frames = data + done * record_size;
+        if (record_crc) {
+            CbGuard commit_guard(commit_lock);
+            for (size_t i = 0; i < run; i++) {
+                size_t pos = ring_add(back, i * frame_size);
+                build_frame(frame_buf + i * frame_size, frames + i * record_size, record_size, lap_of(pos));
+            }
+            frames = frame_buf;
+        }
+        err = write_span(back, frames, run * frame_size);
+        if (err == ESP_OK) { err = fold_back(back, data + done * record_size, run); }
+        if (err != ESP_OK) { break; }
+        back_sec_records += run;
+        if (seal_size != 0 && sec_offset(advance(back, run)) == 0) { err = seal_sec(back - sec_offset(back)); }
+        if (err != ESP_OK) { break; }
+        CbGuard commit_guard(commit_lock);
+        for (size_t i = 0; time_index != NULL && i < run; i++) {
+            index_time(ring_add(back, i * frame_size), data + (done + i) * record_size);
+        }
+        back = advance(back, run);
+        record_num += run;
+        CB_STAT(stats.pushes += run);
+        if (back_cache != NULL) { pending_records += run; }
+        done += run;
+    }
+    if (done == 0) { return err; }
+    CbGuard commit_guard(commit_lock);
+    esp_err_t header_err = record_crc ? pushed(done) : write_header();
+    return err != ESP_OK ? err : header_err;
+}
+
+/**
+ * Allocates the staging ring of push_back_async() and starts the flush task
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::start_async(const cb_config& config) {
+    if (config.async_records == 0) { return ESP_OK; }
+    if (!stage_mutex.init() || !stage_data.init(1) || !stage_space.init(1) || !stage_drained.init(1)) { return ESP_ERR_NO_MEM; }
+    stage = (uint8_t*)malloc(config.async_records * record_size);
+    if (stage == NULL) { return ESP_ERR_NO_MEM; }
+    if (variable_length) {
+        stage_len = (uint16_t*)malloc(config.async_records * sizeof(uint16_t));
+        if (stage_len == NULL) { return ESP_ERR_NO_MEM; }
+    }
+    stage_cap = config.async_records;
+    stage_head = stage_count = 0;
+    stage_stop = stage_flush = false;
+    stage_err = ESP_OK;
+    if (!flusher.start(flush_task, this, "cb_flush", config.async_stack, config.async_priority)) { return ESP_ERR_NO_MEM; }
+    return ESP_OK;
+}
+
+/**
+ * Stops the flush task once it wrote the staged records and frees the staging ring
+ */
+void CircularBuffer::stop_async() {
+    if (stage == NULL) { return; }
+    {
+        CbGuard stage_guard(&stage_mutex);
+        stage_stop = true;
+    }
+    stage_data.give();
+    flusher.join();
+    free(stage);
+    free(stage_len);
+    stage = NULL;
+    stage_len = NULL;
+    stage_cap = 0;
+}
+
+void CircularBuffer::flush_task(void* self) { ((CircularBuffer*)self)->drain_stage(); }
+
+/**
+ * Body of the flush task, writes staged records in batches until stop_async()
+ * While the circular buffer is full the records stay staged and writing them is retried
+ */
+void CircularBuffer::drain_stage() {
+    bool retry = false;
+    while (true) {
+        stage_data.take(retry ? ASYNC_RETRY_MS : CB_WAIT_FOREVER);
+        retry = false;
+        while (true) {
+            size_t start, run;
+            bool stop;
+            {
+                CbGuard stage_guard(&stage_mutex);
+                start = stage_head;
+                run = stage_count < stage_cap - stage_head ? stage_count : stage_cap - stage_head;
+                stop = stage_stop;
+            }
+            if (run == 0) { break; }
+            size_t written = 0;
+            esp_err_t err = write_staged(start, run, &written);
+            retry = err == ESP_ERR_NO_MEM && !stop;
+            {
+                CbGuard stage_guard(&stage_mutex);
+                if (err != ESP_OK && !retry) {
+                    // records that can't be written are dropped, flush_and_wait() reports the error
+                    stage_err = err;
+                    written = run;
+                }
+                stage_head = (stage_head + written) % stage_cap;
+                stage_count -= written;
+            }
+            if (written > 0) { stage_space.give(); }
+            if (retry) { break; }
+        }
+        bool stop, flush_due;
+        {
+            CbGuard stage_guard(&stage_mutex);
+            stop = stage_stop && stage_count == 0;
+            flush_due = stage_flush && stage_count == 0;
+        }
+        if (flush_due) {
+            esp_err_t err = flush();
+            {
+                CbGuard stage_guard(&stage_mutex);
+                if (err != ESP_OK) { stage_err = err; }
+                stage_flush = false;
+            }
+            stage_drained.give();
+        }
+        if (stop) { return; }
+        if (!retry && ahead_target != 0) {
+            // the staging ring absorbs pushes while the next sectors are erased
+            esp_err_t err = erase_ahead();
+            if (err != ESP_OK) {
+                CbGuard stage_guard(&stage_mutex);
+                stage_err = err;
+            }
+        }
+    }
+}
+
+/**
+ * Writes staged records that lie back to back in the staging ring
+ * @param start slot of the first record
+ * @param count number of records
+ * @param written number of records written
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::write_staged(size_t start, size_t count, size_t* written) {
+    *written = 0;
+    if (!variable_length && admit == NULL) {
+        esp_err_t err = push_back_n(stage + start * record_size, count);
+        if (err == ESP_OK) { *written = count; }
+        return err;
+    }
+    for (size_t i = start; i < start + count; i++) {
+        esp_err_t err = push_back(stage + i * record_size, variable_length ? stage_len[i] : record_size);
+        // in overwrite mode only the admit callback refuses a record, which is discarded instead of retried
+        if (err != ESP_OK && !(err == ESP_ERR_NO_MEM && overwrite)) { return err; }
+        (*written)++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Stages data for the flush task to push to the back of circular buffer, without touching flash
+ * @param src source of data
+ * @param timeout_ms how long to wait while the staging ring is full, CB_WAIT_FOREVER waits until there is room
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the staging ring is full and timeout_ms is 0, ESP_ERR_TIMEOUT if it stayed full
+ */
+esp_err_t CircularBuffer::push_back_async(const void* src, uint32_t timeout_ms) { return push_back_async(src, record_size, timeout_ms); }
+
+/**
+ * Stages data for the flush task to push to the back of circular buffer, without touching flash
+ * @param src source of data
+ * @param len length of data, at most record_size in variable length mode and exactly record_size otherwise
+ * @param timeout_ms how long to wait while the staging ring is full, CB_WAIT_FOREVER waits until there is room
+ * @return ESP_OK if ok, ESP_ERR_NO_MEM if the staging ring is full and timeout_ms is 0, ESP_ERR_TIMEOUT if it stayed full
+ */
+esp_err_t CircularBuffer::push_back_async(const void* src, size_t len, uint32_t timeout_ms) {
+    if (stage == NULL) { return ESP_ERR_INVALID_STATE; }
+    if (!len_ok(len)) { return ESP_ERR_INVALID_SIZE; }
+    int64_t deadline = now_ms() + timeout_ms;
+    bool waited = false;
+    while (true) {
+        bool staged = false, room_left = false;
+        {
+            CbGuard stage_guard(&stage_mutex);
+            if (stage_count < stage_cap) {
+                size_t slot = (stage_head + stage_count) % stage_cap;
+                memcpy(stage + slot * record_size, src, len);
+                if (stage_len != NULL) { stage_len[slot] = len; }
+                stage_count++;
+                staged = true;
+                room_left = stage_count < stage_cap;
+            }
+        }
+        if (staged) {
+            stage_data.give();
+            // pass the wakeup on to the next producer waiting for room
+            if (waited && room_left) { stage_space.give(); }
+            return ESP_OK;
+        }
+        if (timeout_ms == 0) { return ESP_ERR_NO_MEM; }
+        int64_t left = deadline - now_ms();
+        if (timeout_ms != CB_WAIT_FOREVER && left <= 0) { return ESP_ERR_TIMEOUT; }
+        stage_space.take(timeout_ms == CB_WAIT_FOREVER ? CB_WAIT_FOREVER : (uint32_t)left);
+        waited = true;
+    }
+}
+
+/**
+ * Waits until the flush task wrote every staged record and committed the header
+ * @param timeout_ms how long to wait, CB_WAIT_FOREVER waits until done
+ * @return ESP_OK if ok, ESP_ERR_TIMEOUT if records are still staged, or the error that made the flush task drop records
+ */
+esp_err_t CircularBuffer::flush_and_wait(uint32_t timeout_ms) {
+    if (stage == NULL) { return flush(); }
+    {
+        CbGuard stage_guard(&stage_mutex);
+        stage_flush = true;
+    }
+    stage_data.give();
+    int64_t deadline = now_ms() + timeout_ms;
+    while (true) {
+        {
+            CbGuard stage_guard(&stage_mutex);
+            if (!stage_flush && stage_count == 0) {
+                esp_err_t err = stage_err;
+                stage_err = ESP_OK;
+                return err;
+            }
+        }
+        int64_t left = deadline - now_ms();
+        if (timeout_ms != CB_WAIT_FOREVER && left <= 0) { return ESP_ERR_TIMEOUT; }
+        stage_drained.take(timeout_ms == CB_WAIT_FOREVER ? CB_WAIT_FOREVER : (uint32_t)left);
+    }
+}
+
+/**
+ * Retrieves data from the front of the circular buffer
+ * @param dest destination of data, room for record_size bytes
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::peek_front (void* dest) { return peek_front(dest, record_size, NULL); }
+
+/**
+ * Retrieves data from the front of the circular buffer
+ * @param dest destination of data
+ * @param max size of destination
+ * @param len length of the record, may be NULL
+ * @return ESP_OK if ok, ESP_ERR_INVALID_SIZE if the record is longer than max
+ */
+esp_err_t CircularBuffer::peek_front(void* dest, size_t max, size_t* len) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (get_record_num() == 0) { return ESP_ERR_NOT_FOUND; }
+    size_t size;
+    size_t pos = front;
+    esp_err_t err = record_at(&pos, &size);
+    if (err != ESP_OK) { return err; }
+    if (pos != front) { set_front(pos); }
+    if (compress_width != 0) {
+        if (len != NULL) { *len = record_size; }
+        if (record_size > max) { return ESP_ERR_INVALID_SIZE; }
+        err = read_span(payload(front), unpack_buf, size);
+        if (err == ESP_OK) { err = check_mirrored(front, unpack_buf, size); }
+        if (err != ESP_OK) { return err; }
+        return unpack_front(unpack_buf, size, dest);
+    }
+    if (len != NULL) { *len = size; }
+    if (size > max) { return ESP_ERR_INVALID_SIZE; }
+    err = read_span(payload(front), dest, size);
+    if (err != ESP_OK) { return err; }
+    return check_mirrored(front, dest, size);
+}
+
+/**
+ * Retrieves a pointer to the data at the front of the circular buffer without copying it
+ * The pointer stays valid until the circular buffer is modified, in CB_LOCK_SPSC mode until the consumer modifies it
+ * @param dest pointer to the data inside a sector cache or the mapping of the storage
+ * @param len length of the record, may be NULL
+ * @return ESP_OK if ok, ESP_ERR_NOT_SUPPORTED if the front sector is neither cached nor mapped or records are compressed
+ */
+esp_err_t CircularBuffer::peek_front_ptr(const void** dest, size_t* len) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (compress_width != 0) { return ESP_ERR_NOT_SUPPORTED; }
+    if (get_record_num() == 0) { return ESP_ERR_NOT_FOUND; }
+    size_t size;
+    size_t pos = front;
+    esp_err_t err = record_at(&pos, &size);
+    if (err != ESP_OK) { return err; }
+    if (pos != front) { set_front(pos); }
+    if (len != NULL) { *len = size; }
+    // the checksum is read from the same sector so the pointer stays valid
+    size_t tail = size + frame_size - record_size;
+    if (sec_size - sec_offset(payload(front)) < tail && !mapped_span(payload(front), tail)) { return ESP_ERR_NOT_SUPPORTED; }
+    err = cached_data(payload(front), dest);
+    if (err != ESP_OK) { return err; }
+    return check_record(front, *dest, size);
+}
+
+/**
+ * Retrieves data from the front of the circular buffer and deletes it
+ * @param dest destination of data, room for record_size bytes
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::pop_front (void* dest) { return pop_front(dest, record_size, NULL); }
+
+/**
+ * Retrieves data from the front of the circular buffer and deletes it
+ * @param dest destination of data
+ * @param max size of destination
+ * @param len length of the record, may be NULL
+ * @return ESP_OK if ok, ESP_ERR_INVALID_SIZE if the record is longer than max (it is not deleted)
+ */
+esp_err_t CircularBuffer::pop_front(void* dest, size_t max, size_t* len) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    esp_err_t err = peek_front(dest, max, len);
+    if (err != ESP_OK) { return err; }
+    return delete_front();
+}
+
+/**
+ * @return Number of records currently in the circular buffer
+ */
+uint32_t CircularBuffer::get_record_num() {
+    CbGuard api_guard(api_lock);
+    CbGuard commit_guard(commit_lock);
+    return record_num;
+}
+
+/**
+ * Retrieves multiple records from the front of the circular buffer and deletes them with a single header commit
+ * Records are read with one read per sector they occupy, with record_crc as many as fit in dest at a time, up to the first corrupted one
+ * @param dest destination of data, room for max records laid out back to back
+ * @param max maximum number of records to retrieve
+ * @param out number of records retrieved
+ * @return ESP_OK if ok, ESP_ERR_INVALID_CRC if the front record is corrupted
+ */
+esp_err_t CircularBuffer::pop_front_n(void* dest, size_t max, size_t* out) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    *out = 0;
+    if (variable_length) { return ESP_ERR_NOT_SUPPORTED; }
+    size_t available = get_record_num();
+    if (available == 0) { return ESP_ERR_NOT_FOUND; }
+    size_t count = max < available ? max : available;
+    uint8_t* data = (uint8_t*)dest;
+    size_t popped = 0;
+    size_t pos = front;
+    bool intact = true;
+    while (popped < count && intact) {
+        size_t run = count - popped;
+        if (!span_sectors && (sec_space - sec_offset(pos)) / frame_size < run) { run = (sec_space - sec_offset(pos)) / frame_size; }
+        uint8_t* records = data + popped * record_size;
+        esp_err_t err;
+        if (!record_crc) { err = read_span(pos, records, run * record_size); }
+        else if ((count - popped) * record_size < frame_size) {
+            // no room left for a whole frame, the last record is checked on its own
+            run = 1;
+            err = read_span(pos, records, record_size);
+            if (err == ESP_OK) { err = check_mirrored(pos, records, record_size); }
+        } else {
+            // the frames that fit in the room left are read at once and their checksums are dropped in place
+            if ((count - popped) * record_size / frame_size < run) { run = (count - popped) * record_size / frame_size; }
+            err = read_span(pos, records, run * frame_size);
+            for (size_t i = 0; err == ESP_OK && i < run; i++) {
+                const uint8_t* frame = records + i * frame_size;
+                size_t at = advance(pos, i);
+                if (!frame_valid(at, frame, frame_size)) {
+                    if (!mirror_frame(at, mirror_buf, frame_size)) {
+                        intact = false;
+                        run = i;
+                        break;
+                    }
+                    frame = mirror_buf;
+                }
+                memmove(records + i * record_size, frame, record_size);
+            }
+            // the records before a corrupted one are still popped
+            if (!intact && run == 0) { err = ESP_ERR_INVALID_CRC; }
+        }
+        if (err != ESP_OK) {
+            if (popped == 0) { return err; }
+            break;
+        }
+        pos = advance(pos, run);
+        popped += run;
+    }
+    CbGuard commit_guard(commit_lock);
+    set_front(pos);
+    record_num -= popped;
+    *out = popped;
+    return deleted(popped);
+}
+
+/**
+ * Starts a cursor at the front of the circular buffer, to stream records with read_chunk()
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::get_cursor(cb_cursor* cursor) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    CbGuard commit_guard(commit_lock);
+    cursor->pos = cursor->front = front;
+    cursor->front_lap = front_lap;
+    cursor->records = 0;
+    return ESP_OK;
+}
+
+/**
+ * Copies the records following a cursor without deleting them, as the bytes they are stored as: each record with its
+ * length prefix in variable length mode and its checksum with record_crc, back to back
+ * Records are read with one read per sector they occupy and copied up to the first corrupted one, ack() deletes them once they have been handled
+ * @param dest destination of the records
+ * @param max size of dest, only whole records are copied
+ * @param cursor position of the reader, moved past the copied records
+ * @param len number of bytes copied
+ * @return ESP_OK if ok, ESP_ERR_NOT_FOUND if no record follows the cursor, ESP_ERR_INVALID_SIZE if the next record
+ * doesn't fit in max, ESP_ERR_INVALID_CRC if it is corrupted, ESP_ERR_INVALID_STATE if the front moved since the cursor was started,
+ * ESP_ERR_NOT_SUPPORTED if records are compressed
+ */
+esp_err_t CircularBuffer::read_chunk(void* dest, size_t max, cb_cursor* cursor, size_t* len) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    *len = 0;
+    if (compress_width != 0) { return ESP_ERR_NOT_SUPPORTED; }
+    size_t remaining;
+    {
+        CbGuard commit_guard(commit_lock);
+        if (cursor->front != front || cursor->front_lap != front_lap || cursor->records > record_num) { return ESP_ERR_INVALID_STATE; }
+        remaining = record_num - cursor->records;
+    }
+    if (remaining == 0) { return ESP_ERR_NOT_FOUND; }
+    uint8_t* data = (uint8_t*)dest;
+    size_t copied = 0;
+    size_t taken = 0;
+    size_t pos = cursor->pos;
+    esp_err_t err = ESP_OK;
+    while (taken < remaining) {
+        size_t room = max - copied;
+        size_t bytes = 0;
+        size_t run = 0;
+        size_t next = pos;
+        if (variable_length) {
+            size_t size;
+            err = record_at(&pos, &size);
+            if (err != ESP_OK || LEN_SIZE + size + frame_size - record_size > room) { break; }
+            if (sec_space - sec_offset(pos) < room) { room = sec_space - sec_offset(pos); }
+            err = read_data(pos, data + copied, room);
+            if (err != ESP_OK) { break; }
+            // the records of the sector are found in what was read, up to the first that doesn't fit
+            next = pos;
+            while (taken + run < remaining && bytes + LEN_SIZE <= room) {
+                uint16_t prefix;
+                memcpy(&prefix, data + copied + bytes, LEN_SIZE);
+                size_t frame = LEN_SIZE + prefix + frame_size - record_size;
+                if (prefix > record_size || bytes + frame > room) { break; }
+                if (record_crc && !frame_valid(next, data + copied + bytes, frame) && !mirror_frame(next, data + copied + bytes, frame)) {
+                    err = ESP_ERR_INVALID_CRC;
+                    break;
+                }
+                bytes += frame;
+                run++;
+                next = next_record(next, prefix);
+                if (sec_offset(next) == 0) { break; }
+            }
+        } else {
+            run = remaining - taken;
+            if (!span_sectors && (sec_space - sec_offset(pos)) / frame_size < run) { run = (sec_space - sec_offset(pos)) / frame_size; }
+            if (room / frame_size < run) { run = room / frame_size; }
+            if (run == 0) { break; }
+            err = read_span(pos, data + copied, run * frame_size);
+            if (err != ESP_OK) { break; }
+            for (size_t i = 0; record_crc && i < run; i++) {
+                size_t at = advance(pos, i);
+                if (!frame_valid(at, data + copied + i * frame_size, frame_size) && !mirror_frame(at, data + copied + i * frame_size, frame_size)) {
+                    err = ESP_ERR_INVALID_CRC;
+                    run = i;
+                }
+            }
+            bytes = run * frame_size;
+            next = advance(pos, run);
+        }
+        if (run == 0) { break; }
+        copied += bytes;
+        taken += run;
+        pos = next;
+    }
+    if (taken == 0) { return err != ESP_OK ? err : ESP_ERR_INVALID_SIZE; }
+    cursor->pos = pos;
+    cursor->records += taken;
+    *len = copied;
+    return ESP_OK;
+}
+
+/**
+ * Deletes the records read with a cursor with a single header commit, the cursor then starts at the new front
+ * @return ESP_OK if ok, ESP_ERR_INVALID_STATE if the front moved since the cursor was started
+ */
+esp_err_t CircularBuffer::ack(cb_cursor* cursor) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    CbGuard commit_guard(commit_lock);
+    if (cursor->front != front || cursor->front_lap != front_lap || cursor->records > record_num) { return ESP_ERR_INVALID_STATE; }
+    size_t count = cursor->records;
+    if (count == 0) { return ESP_OK; }
+    set_front(cursor->pos);
+    record_num -= count;
+    cursor->front = front;
+    cursor->front_lap = front_lap;
+    cursor->records = 0;
+    return deleted(count);
+}
+
+/**
+ * Retrieves a record anywhere in the circular buffer without deleting it
+ * @param index index of the record counted from the front, 0 is the front
+ * @param dest destination of data, room for record_size bytes
+ * @return ESP_OK if ok, ESP_ERR_NOT_FOUND if there is no record at index,
+ * ESP_ERR_NOT_SUPPORTED in variable length mode where records can't be located without walking them
+ */
+esp_err_t CircularBuffer::read_at(size_t index, void* dest) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (variable_length) { return ESP_ERR_NOT_SUPPORTED; }
+    if (index >= get_record_num()) { return ESP_ERR_NOT_FOUND; }
+    size_t pos = position_of(index);
+    esp_err_t err = read_span(pos, dest, record_size);
+    if (err != ESP_OK) { return err; }
+    return check_mirrored(pos, dest, record_size);
+}
+
+/**
+ * @return Timestamp of a record in time series mode
+ */
+uint64_t CircularBuffer::time_of(const void* record) {
+    uint64_t time = 0;
+    memcpy(&time, record, timestamp_size);
+    return time;
+}
+
+/**
+ * Checks that records about to be pushed in time series mode are not older than the newest record
+ * @param src source of data, count records laid out back to back
+ * @return ESP_OK if ok, ESP_ERR_INVALID_ARG if a timestamp decreases
+ */
+esp_err_t CircularBuffer::check_times(const void* src, size_t count) {
+    if (time_index == NULL) { return ESP_OK; }
+    uint64_t newest;
+    {
+        CbGuard commit_guard(commit_lock);
+        newest = record_num > 0 ? last_time : 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint64_t time = time_of((const uint8_t*)src + i * record_size);
+        if (time < newest) { return ESP_ERR_INVALID_ARG; }
+        newest = time;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Adds a record to the time range of the sector it starts in, called with commit_lock held
+ * @param pos position of the record
+ */
+void CircularBuffer::index_time(size_t pos, const void* record) {
+    if (time_index == NULL) { return; }
+    cb_sector_times* times = &time_index[sec_index(pos)];
+    uint64_t time = time_of(record);
+    if (times->count == 0) { times->first = time; }
+    times->last = time;
+    times->count++;
+    last_time = time;
+}
+
+/**
+ * Builds the time index of time series mode by reading each sector holding records once
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::build_time_index() {
+    if (timestamp_size == 0) { return ESP_OK; }
+    time_index = (cb_sector_times*)calloc(sec_count, sizeof(cb_sector_times));
+    if (time_index == NULL) { return ESP_ERR_NO_MEM; }
+    if (record_num == 0) { return ESP_OK; }
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = ESP_OK;
+    size_t loaded = SIZE_MAX;
+    size_t pos = front;
+    for (size_t i = 0; i < record_num; i++) {
+        uint64_t time;
+        err = read_time(pos, sector, &loaded, &time);
+        if (err != ESP_OK) { break; }
+        index_time(pos, &time);
+        pos = advance(pos, 1);
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Reads the timestamp of a record through a buffer holding one sector
+ * @param pos position of the record
+ * @param sector buffer of one sector
+ * @param loaded start of the sector in the buffer, SIZE_MAX if none, updated when another sector is read
+ * @param time timestamp of the record
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::read_time(size_t pos, uint8_t* sector, size_t* loaded, uint64_t* time) {
+    *time = 0;
+    // only a record spanning sectors can have its timestamp cut by the end of one
+    if (sec_size - sec_offset(pos) < timestamp_size) { return read_span(pos, time, timestamp_size); }
+    size_t sec = pos - sec_offset(pos);
+    if (sec != *loaded) {
+        esp_err_t err = read_uncached(sec, sector, sec_size);
+        if (err != ESP_OK) { return err; }
+        *loaded = sec;
+    }
+    *time = time_of(sector + sec_offset(pos));
+    return ESP_OK;
+}
+
+/**
+ * Writes the seal of the back sector as the back leaves it, holding the number of records starting in the sector
+ * The seal is checksummed with the lap of its own position, which the front doesn't pass while the records of the
+ * sector are kept, so seals left from earlier laps don't match
+ * @param sec start of the sector relative to the data area
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::seal_sec(size_t sec) {
+    uint32_t records = back_sec_records;
+    back_sec_records = 0;
+    if (seal_size == 0) { return ESP_OK; }
+    uint32_t seed;
+    {
+        CbGuard commit_guard(commit_lock);
+        seed = lap_of(sec + sec_space + footer_size);
+    }
+    uint8_t seal[SEAL_SIZE];
+    memcpy(seal, &records, sizeof(records));
+    uint32_t crc = cb_crc32(seed, seal, sizeof(records));
+    memcpy(seal + sizeof(records), &crc, TAG_SIZE);
+    return write_data(sec + sec_space + footer_size, seal, SEAL_SIZE);
+}
+
+/**
+ * Reads the seal of a sector
+ * @param sec start of the sector relative to the data area
+ * @param records number of records starting in the sector, 0 if it was not sealed in the current lap
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::read_seal(size_t sec, uint32_t* records) {
+    *records = 0;
+    if (seal_size == 0) { return ESP_OK; }
+    uint8_t seal[SEAL_SIZE];
+    esp_err_t err = flash_read(data_offset + sec + sec_space + footer_size, seal, SEAL_SIZE);
+    if (err != ESP_OK) { return err; }
+    uint32_t crc;
+    memcpy(&crc, seal + sizeof(uint32_t), TAG_SIZE);
+    // an erased seal passes the check in the first lap
+    if (!is_all_ff(seal, SEAL_SIZE) && cb_crc32(lap_of(sec + sec_space + footer_size), seal, sizeof(uint32_t)) == crc) { memcpy(records, seal, sizeof(uint32_t)); }
+    return ESP_OK;
+}
+
+/**
+ * Counts the records starting in the back sector before the back, which its seal will hold
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::count_back_records() {
+    back_sec_records = 0;
+    if (seal_size == 0 || sec_offset(back) == 0) { return ESP_OK; }
+    if (!variable_length) {
+        back_sec_records = sec_offset(back) / frame_size;
+        return ESP_OK;
+    }
+    size_t sec = back - sec_offset(back);
+    uint8_t* sector = (uint8_t*)malloc(sec_offset(back));
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = flash_read(data_offset + sec, sector, sec_offset(back));
+    for (size_t pos = sec; err == ESP_OK && pos < back && sec_offset(pos) + LEN_SIZE <= sec_offset(back);) {
+        uint16_t prefix;
+        memcpy(&prefix, sector + sec_offset(pos), LEN_SIZE);
+        if (prefix > record_size) { break; }
+        back_sec_records++;
+        pos = next_record(pos, prefix);
+        if (sec_offset(pos) == 0) { break; }
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Folds records written at the back into the summary of the back sector, writing its footer once the sector is full
+ * The footer is written before the last record is published, without it the sector is summarized from its records
+ * @param pos position of the first record
+ * @param src source of data, count records laid out back to back
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::fold_back(size_t pos, const void* src, size_t count) {
+    if (aggregator == NULL) { return ESP_OK; }
+    for (size_t i = 0; i < count; i++) { aggregator->add(back_state, (const uint8_t*)src + i * record_size); }
+    if (sec_offset(advance(pos, count)) != 0) { return ESP_OK; }
+    size_t footer = pos - sec_offset(pos) + sec_space;
+    uint32_t seed;
+    {
+        // seeded like records so a footer left from an earlier lap of the sector doesn't pass
+        CbGuard commit_guard(commit_lock);
+        seed = lap_of(footer);
+    }
+    memcpy(footer_buf, back_state, aggregator->size);
+    uint32_t crc = cb_crc32(seed, footer_buf, aggregator->size);
+    memcpy(footer_buf + aggregator->size, &crc, TAG_SIZE);
+    aggregator->reset(back_state);
+    return write_data(footer, footer_buf, footer_size);
+}
+
+/**
+ * Summarizes the records already written to the back sector when aggregate footers are enabled
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::load_back_state() {
+    if (aggregator == NULL) { return ESP_OK; }
+    back_state = (uint8_t*)malloc(aggregator->size);
+    footer_buf = (uint8_t*)malloc(footer_size);
+    if (back_state == NULL || footer_buf == NULL) { return ESP_ERR_NO_MEM; }
+    aggregator->reset(back_state);
+    if (sec_offset(back) == 0) { return ESP_OK; }
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    size_t sec = back - sec_offset(back);
+    esp_err_t err = read_uncached(sec, sector, sec_size);
+    for (size_t pos = sec; err == ESP_OK && pos < back; pos += frame_size) {
+        const uint8_t* frame = sector + sec_offset(pos);
+        if (!record_crc || frame_valid(pos, frame, frame_size)) { aggregator->add(back_state, frame); }
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Decodes the compressed records of a sector up to a position, reading the sector once
+ * A record that does not decode is taken as zeros, as it is on every path that decodes it
+ * @param pos position in the sector, the records before it are decoded
+ * @param ref destination of the record before pos, room for record_size bytes
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::unpack_to(size_t pos, uint8_t* ref) {
+    size_t sec = pos - sec_offset(pos);
+    uint8_t* sector = (uint8_t*)malloc(sec_offset(pos) + record_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    uint8_t* record = sector + sec_offset(pos);
+    esp_err_t err = read_uncached(sec, sector, sec_offset(pos));
+    for (size_t at = sec; err == ESP_OK && at < pos;) {
+        uint16_t prefix;
+        memcpy(&prefix, sector + sec_offset(at), LEN_SIZE);
+        if (prefix > record_size) {
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        if (!unpack(sector + sec_offset(at) + LEN_SIZE, prefix, at == sec ? NULL : ref, record)) { memset(record, 0, record_size); }
+        memcpy(ref, record, record_size);
+        at = next_record(at, prefix);
+        if (sec_offset(at) == 0) { break; }
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Decodes the compressed record at the front, continuing from the record decoded last when it precedes the front
+ * @param src encoding read from the front
+ * @param len length of the encoding
+ * @param dest destination, room for record_size bytes
+ * @return ESP_OK if ok, ESP_ERR_INVALID_STATE if the record does not decode
+ */
+esp_err_t CircularBuffer::unpack_front(const uint8_t* src, size_t len, void* dest) {
+    const uint8_t* ref = NULL;
+    if (sec_offset(front) != 0) {
+        if (last_valid && last_next == front) {
+            // moving on to the next record, the record decoded last becomes its predecessor
+            uint8_t* swap = prev_ref;
+            prev_ref = last_ref;
+            last_ref = swap;
+            prev_next = front;
+            prev_valid = true;
+        } else if (!prev_valid || prev_next != front) {
+            prev_valid = false;
+            esp_err_t err = unpack_to(front, prev_ref);
+            if (err != ESP_OK) { return err; }
+            prev_next = front;
+            prev_valid = true;
+        }
+        ref = prev_ref;
+    }
+    last_valid = false;
+    if (!unpack(src, len, ref, last_ref)) { return ESP_ERR_INVALID_STATE; }
+    memcpy(dest, last_ref, record_size);
+    last_next = next_record(front, len);
+    last_valid = true;
+    return ESP_OK;
+}
+
+/**
+ * Allocates the buffers of record compression and decodes the records already written to the back sector
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::load_refs() {
+    if (compress_width == 0) { return ESP_OK; }
+    pack_buf = (uint8_t*)malloc(record_size);
+    unpack_buf = (uint8_t*)malloc(record_size);
+    back_ref = (uint8_t*)malloc(record_size);
+    prev_ref = (uint8_t*)malloc(record_size);
+    last_ref = (uint8_t*)malloc(record_size);
+    if (pack_buf == NULL || unpack_buf == NULL || back_ref == NULL || prev_ref == NULL || last_ref == NULL) { return ESP_ERR_NO_MEM; }
+    prev_valid = last_valid = false;
+    return sec_offset(back) == 0 ? ESP_OK : unpack_to(back, back_ref);
+}
+
+/**
+ * Summarizes a range of records with the aggregator
+ * Sectors the range covers completely are summarized by their footers, only the others are read
+ * @param first index of the first record counted from the front
+ * @param count number of records
+ * @param result destination of the summary, room for the size of the aggregator
+ * @return ESP_OK if ok, ESP_ERR_NOT_FOUND if the range goes past the back, ESP_ERR_INVALID_STATE without an aggregator
+ */
+esp_err_t CircularBuffer::aggregate(size_t first, size_t count, void* result) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (aggregator == NULL) { return ESP_ERR_INVALID_STATE; }
+    size_t available = get_record_num();
+    if (first > available || count > available - first) { return ESP_ERR_NOT_FOUND; }
+    aggregator->reset(result);
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = ESP_OK;
+    size_t end = first + count;
+    for (size_t i = first; err == ESP_OK && i < end;) {
+        size_t pos = position_of(i);
+        size_t run = (sec_space - sec_offset(pos)) / frame_size;
+        if (run > end - i) { run = end - i; }
+        if (sec_offset(pos) == 0 && run == sec_records) {
+            err = read_uncached(pos + sec_space, sector, footer_size);
+            if (err != ESP_OK) { break; }
+            uint32_t tag;
+            memcpy(&tag, sector + aggregator->size, TAG_SIZE);
+            if (cb_crc32(lap_of(pos + sec_space), sector, aggregator->size) == tag) {
+                aggregator->merge(result, sector);
+                i += run;
+                continue;
+            }
+        }
+        err = read_uncached(pos, sector, run * frame_size);
+        for (size_t j = 0; err == ESP_OK && j < run; j++) {
+            const uint8_t* frame = sector + j * frame_size;
+            // a record torn by a crash is left out
+            if (!record_crc || frame_valid(pos + j * frame_size, frame, frame_size)) { aggregator->add(result, frame); }
+        }
+        i += run;
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Finds the oldest record whose timestamp is not before time in time series mode
+ * The sector holding it is found by a binary search over the time index, then only that sector is read
+ * @param time timestamp to look for
+ * @param index index of the record counted from the front, for read_at()
+ * @return ESP_OK if ok, ESP_ERR_NOT_FOUND if every record is older, ESP_ERR_INVALID_STATE if time series mode is off
+ */
+esp_err_t CircularBuffer::seek_time(uint64_t time, size_t* index) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (time_index == NULL) { return ESP_ERR_INVALID_STATE; }
+    size_t count = get_record_num();
+    if (count == 0) { return ESP_ERR_NOT_FOUND; }
+    size_t first_sec = sec_index(front);
+    size_t secs = (sec_index(position_of(count - 1)) + sec_count - first_sec) % sec_count + 1;
+    size_t low = 0, high = secs;
+    {
+        CbGuard commit_guard(commit_lock);
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            // a sector in which no record starts takes the times of the sector before it, so they keep increasing
+            size_t sec = mid;
+            while (sec > 0 && time_index[(first_sec + sec) % sec_count].count == 0) { sec--; }
+            if (time_index[(first_sec + sec) % sec_count].last < time) { low = mid + 1; }
+            else { high = mid; }
+        }
+    }
+    if (low == secs) { return ESP_ERR_NOT_FOUND; }
+    // index of the first record starting in the sector found
+    size_t i = 0;
+    if (low > 0) {
+        size_t skipped = low * sec_size - sec_offset(front);
+        i = span_sectors ? (skipped + frame_size - 1) / frame_size : (sec_space - sec_offset(front)) / frame_size + (low - 1) * sec_records;
+    }
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    if (sector == NULL) { return ESP_ERR_NO_MEM; }
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    size_t loaded = SIZE_MAX;
+    for (; i < count; i++) {
+        uint64_t record_time;
+        esp_err_t read_err = read_time(position_of(i), sector, &loaded, &record_time);
+        if (read_err != ESP_OK) {
+            err = read_err;
+            break;
+        }
+        if (record_time >= time) {
+            *index = i;
+            err = ESP_OK;
+            break;
+        }
+    }
+    free(sector);
+    return err;
+}
+
+/**
+ * Reads data without loading its sector into the front cache, from the back sector cache if it holds the sector
+ * Used by walks over many sectors that would otherwise evict the front sector
+ * @param pos position relative to the data area, the data must lie in one sector
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::read_uncached(size_t pos, void* dest, size_t len) {
+    {
+        CbGuard commit_guard(commit_lock);
+        if (back_cache_valid && pos - sec_offset(pos) == back_cache_sec) {
+            memcpy(dest, back_cache + sec_offset(pos), len);
+            return ESP_OK;
+        }
+    }
+    return flash_read(data_offset + pos, dest, len);
+}
+
+/**
+ * @return Whether data crossing sectors lies contiguously in the mapping of the storage, which holds when records
+ * are written straight to flash and the data does not wrap around the end of the data area
+ */
+bool CircularBuffer::mapped_span(size_t pos, size_t len) { return storage.mapped != NULL && back_cache == NULL && pos + len <= ring_size; }
+
+/**
+ * Makes a sector readable in memory, pointing into the mapping of the storage unless the back sector cache holds it
+ * @param sec start of the sector relative to the data area
+ * @param buffer room for a sector, filled if the sector is not mapped
+ * @param data the sector in memory
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::map_sec(size_t sec, uint8_t* buffer, const uint8_t** data) {
+    if (storage.mapped != NULL) {
+        CbGuard commit_guard(commit_lock);
+        if (!back_cache_valid || sec != back_cache_sec) {
+            *data = storage.mapped + data_offset + sec;
+            return ESP_OK;
+        }
+    }
+    *data = buffer;
+    return read_uncached(sec, buffer, sec_size);
+}
+
+/**
+ * Visits the records from front to back without deleting them, reading each sector once
+ * In CB_LOCK_SPSC mode this is a consumer call and holds off deletes for the whole walk
+ * @param visit called with the data and length of every record, returns false to stop the walk;
+ * the data is only valid during the call, on mapped storage it points into the mapping
+ * @param arg passed on to visit
+ * @return ESP_OK if ok, ESP_ERR_INVALID_CRC if the walk stopped at a corrupted record
+ */
+esp_err_t CircularBuffer::for_each(bool (*visit)(const void* record, size_t len, void* arg), void* arg) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    size_t count = get_record_num();
+    if (count == 0) { return ESP_OK; }
+    uint8_t* sector = (uint8_t*)malloc(sec_size);
+    // records crossing into the next sector are put together here, decoded records alternate with their predecessor
+    uint8_t* frame = span_sectors || compress_width != 0 ? (uint8_t*)malloc(span_sectors ? frame_size : 2 * record_size) : NULL;
+    if (sector == NULL || ((span_sectors || compress_width != 0) && frame == NULL)) {
+        free(sector);
+        free(frame);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    size_t loaded = SIZE_MAX;
+    const uint8_t* base = sector;
+    size_t pos = front;
+    uint8_t* ref = frame;
+    uint8_t* record = compress_width != 0 ? frame + record_size : NULL;
+    if (compress_width != 0 && sec_offset(pos) != 0) { err = unpack_to(pos, ref); }
+    size_t visited = 0;
+    while (err == ESP_OK && visited < count) {
+        size_t sec = pos - sec_offset(pos);
+        if (sec != loaded) {
+            err = map_sec(sec, sector, &base);
+            if (err != ESP_OK) { break; }
+            loaded = sec;
+        }
+        size_t len = record_size;
+        if (variable_length) {
+            uint16_t prefix;
+            memcpy(&prefix, base + sec_offset(pos), LEN_SIZE);
+            if (prefix == LEN_UNUSED) {
+                pos = next_sec(pos);
+                continue;
+            }
+            if (prefix > record_size) {
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            len = prefix;
+        }
+        size_t frame_len = variable_length ? LEN_SIZE + len + frame_size - record_size : frame_size;
+        const uint8_t* data = base + sec_offset(pos);
+        if (sec_size - sec_offset(pos) < frame_len && !mapped_span(pos, frame_len)) {
+            err = read_span(pos, frame, frame_len);
+            if (err != ESP_OK) { break; }
+            data = frame;
+        }
+        if (record_crc && !frame_valid(pos, data, frame_len)) {
+            if (!mirror_frame(pos, mirror_buf, frame_len)) {
+                err = ESP_ERR_INVALID_CRC;
+                break;
+            }
+            data = mirror_buf;
+        }
+        if (compress_width != 0) {
+            if (!unpack(data + LEN_SIZE, len, sec_offset(pos) == 0 ? NULL : ref, record)) {
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            if (!visit(record, record_size, arg)) { break; }
+            uint8_t* swap = ref;
+            ref = record;
+            record = swap;
+        } else if (!visit(variable_length ? data + LEN_SIZE : data, len, arg)) { break; }
+        pos = next_record(pos, len);
+        visited++;
+    }
+    free(sector);
+    free(frame);
+    return err;
+}
+
+/**
+ * Deletes one record from the front of the circular buffer
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::delete_front() {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (get_record_num() == 0) { return ESP_ERR_NOT_FOUND; }
+    size_t pos = front;
+    size_t len;
+    esp_err_t err = record_at(&pos, &len);
+    if (err != ESP_OK) { return err; }
+    CbGuard commit_guard(commit_lock);
+    set_front(next_record(pos, len));
+    record_num--;
+    return deleted(1);
+}
+
+/**
+ * Deletes multiple records from the front of the circular buffer with a single header commit
+ * Fixed size records are skipped arithmetically, variable length records by reading their length prefixes
+ * @param count number of records
+ * @return ESP_OK if ok, ESP_ERR_NOT_FOUND if fewer records are stored (nothing is deleted)
+ */
+esp_err_t CircularBuffer::delete_front_n(size_t count) {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    if (count > get_record_num()) { return ESP_ERR_NOT_FOUND; }
+    if (count == 0) { return ESP_OK; }
+    size_t pos = front;
+    if (variable_length) {
+        for (size_t i = 0; i < count; i++) {
+            size_t len;
+            esp_err_t err = record_at(&pos, &len);
+            if (err != ESP_OK) { return err; }
+            pos = next_record(pos, len);
+        }
+    } else {
+        pos = position_of(count);
+    }
+    CbGuard commit_guard(commit_lock);
+    set_front(pos);
+    record_num -= count;
+    return deleted(count);
+}
+
+/**
+ * Deletes every record by moving the front to the back, the data sectors are erased when the back reaches them
+ * @return ESP_OK if ok
+ */
+esp_err_t CircularBuffer::clear() {
+    CbGuard api_guard(api_lock);
+    CbGuard front_guard(front_lock);
+    CbGuard commit_guard(commit_lock);
+    if (record_num == 0) { return ESP_OK; }
+    size_t count = record_num;
+    set_front(back);
+    record_num = 0;
+    return deleted(count);
+}
+
+/**
+ * @return Capacity of the circular buffer, in bytes including length prefixes in variable length mode
+ * Records spanning sectors never enter the sector holding the front, so the capacity counts the records that always
+ * fit in the rest of the ring
+ */
+size_t CircularBuffer::get_max_records() {
+    if (variable_length) { return ring_size; }
+    return span_sectors ? (ring_size - sec_size) / frame_size : sec_count * sec_records;
+}
+
+/**
+ * Copies the counters kept since the circular buffer was created or reset_stats() was called
+ * @param stats receives the counters
+ * @return ESP_OK if ok, ESP_ERR_NOT_SUPPORTED if built without CB_STATS
+ */
+esp_err_t CircularBuffer::get_stats(cb_stats* stats) {
+#ifdef CB_STATS
+    CbGuard api_guard(api_lock);
+    CbGuard commit_guard(commit_lock);
+    CbGuard stats_guard(stats_lock);
+    *stats = this->stats;
+    return ESP_OK;
+#else
+    (void)stats;
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/**
+ * Sets every counter to 0
+ */
+void CircularBuffer::reset_stats() {
+#ifdef CB_STATS
+    CbGuard api_guard(api_lock);
+    CbGuard commit_guard(commit_lock);
+    CbGuard stats_guard(stats_lock);
+    stats = cb_stats();
+#endif
+}
+
+/**
+ * Derives the back of the circular buffer from front and record_num, used when recovering state in init()
+ * @return Position of the next record relative to the data area
+ */
+size_t CircularBuffer::get_back() { return position_of(record_num); }
+
+/**
+ * Finds a fixed size record by its index counted from the front
+ * @param index index of the record, 0 is the front
+ * @return Position of the record relative to the data area
+ */
+size_t CircularBuffer::position_of(size_t index) {
+    if (span_sectors) { return ring_add(front, index * frame_size); }
+    uint32_t remaining_capacity_in_front_sector = (sec_space - sec_offset(front)) / frame_size;
+    if (remaining_capacity_in_front_sector > index) { return front + (index * frame_size); }
     else {
-        uint32_t remaining_records = record_num - remaining_capacity_in_front_sector;
-        uint32_t full_secs = remaining_records / records_in_sec();
-        uint32_t front_sec = front / sec_size;
-        uint32_t back_sec = (front_sec + full_secs + 1) % sec_num();
-        size_t back_offset_in_sec = (remaining_records % records_in_sec()) * record_size;
+        uint32_t remaining_records = index - remaining_capacity_in_front_sector;
+        uint32_t full_secs = remaining_records / sec_records;
+        uint32_t front_sec = sec_index(front);
+        uint32_t back_sec = front_sec + full_secs + 1;
+        if (back_sec >= sec_count) { back_sec -= sec_count; }
+        size_t back_offset_in_sec = (remaining_records % sec_records) * frame_size;
         return back_sec * sec_size + back_offset_in_sec;
     }
 }
\ No newline at end of file
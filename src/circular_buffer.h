@@ -1,34 +1,378 @@
-#include "wear_levelling.h"
+#pragma once
 
+#include "cb_os.h"
+#include "cb_storage.h"
+
+// header committed to the storage, of fixed width fields so an image is read the same on every target
 struct cb_header {
     uint32_t magic;
-    size_t front;
+    // version of the format, 0 for a header converted from the format without one
+    uint8_t version;
+    // layout of the records the buffer was created with, init() refuses to read them with another one
+    uint8_t layout;
+    uint16_t footer_size;
+    uint32_t record_size;
+    uint32_t front;
     uint32_t record_num;
     uint32_t sequence;
+    // lap of the front, seeding record checksums; the unversioned header of released firmware has no lap and is
+    // converted by init() with the lap set to 0
+    uint32_t front_lap;
     uint32_t crc;
 };
+static_assert(sizeof(cb_header) == 32, "the header has no padding");
+
+// time range of the records starting in one data sector, kept in RAM in time series mode
+struct cb_sector_times {
+    uint64_t first;
+    uint64_t last;
+    uint32_t count;
+};
+
+// summary of records with a fixed layout, folded into a footer at the end of every data sector
+struct cb_aggregator {
+    // size of the summary in bytes
+    size_t size;
+    // sets a summary to that of no records
+    void (*reset)(void* state);
+    // folds one record into a summary, the record may not be aligned
+    void (*add)(void* state, const void* record);
+    // folds another summary into a summary
+    void (*merge)(void* state, const void* other);
+};
+
+enum cb_locking {
+    // no locking, every call comes from one task
+    CB_LOCK_NONE,
+    // one task pushes while another one peeks, pops and deletes, only the shared counters and the
+    // header commit are serialized so neither task waits for the flash accesses of the other; with overwrite
+    // the producer may drop the front between a peek_front() and a delete_front(), pop_front() is atomic
+    CB_LOCK_SPSC,
+    // every call is serialized, for any number of producers and consumers
+    CB_LOCK_MUTEX,
+};
+
+struct cb_config {
+    bool overwrite = false;
+    bool recovery_mode = false;
+    // append headers to the active slot instead of erasing it on every commit
+    bool journal = false;
+    // keep the sector at the back in RAM and write its records in one wl_write per flush, records still pending are
+    // written when the circular buffer is destroyed or initialized again
+    bool cache_back = false;
+    // keep the sector at the front in RAM so reading it takes one wl_read
+    bool cache_front = false;
+    // with cache_back, flush once this many records or bytes are pending (0 waits for flush() or a full sector)
+    size_t flush_records = 0;
+    size_t flush_bytes = 0;
+    // store records of any length up to record_size, each prefixed with its length
+    bool variable_length = false;
+    // let fixed size records cross sector boundaries so no space is lost at the end of a sector,
+    // which also allows records larger than a sector
+    bool span_sectors = false;
+    // end every record with a checksum seeded with its lap, which marks it as written, so init() recovers
+    // records pushed after the last header commit and reads return ESP_ERR_INVALID_CRC on corrupted records
+    bool record_crc = false;
+    // with record_crc, commit the header once this many records were pushed or deleted or this many
+    // milliseconds passed since the last commit (both 0 commit on every operation)
+    uint32_t checkpoint_records = 0;
+    uint32_t checkpoint_ms = 0;
+    cb_locking locking = CB_LOCK_NONE;
+    // stage up to this many records in RAM for push_back_async(), a flush task writes them in batches and is
+    // then the only producer, so CB_LOCK_NONE is raised to CB_LOCK_SPSC
+    size_t async_records = 0;
+    // stack size and priority of the flush task on the device
+    uint32_t async_stack = 4096;
+    uint32_t async_priority = 5;
+    // keep this many free sectors past the back erased so a push entering a new sector only writes,
+    // they are erased by erase_ahead() and by the flush task in async mode
+    uint32_t erase_ahead = 0;
+    // time series mode for fixed size records: the first 4 or 8 bytes of every record are its timestamp in little
+    // endian, which must not decrease; the time range of every sector is indexed in RAM so seek_time() reads one sector
+    uint8_t timestamp_size = 0;
+    // for fixed size records that don't span sectors, summarize the records of every sector with this aggregator
+    // in a footer written when the back leaves the sector, so aggregate() only reads the records of partly covered
+    // sectors; the aggregator must outlive the circular buffer
+    const cb_aggregator* aggregator = NULL;
+    // compress fixed size records by storing the zig-zag varint deltas of their little endian words of this
+    // many bytes (1, 2 or 4) against the previous record of the same sector, so slowly changing values take a
+    // byte per word; records are kept in the variable length layout and stored as they are when that is not
+    // shorter, every sector decodes on its own
+    uint8_t compress_width = 0;
+    // end every data sector that doesn't span with a seal holding the number of records starting in it, written when
+    // the back leaves the sector, so init() skips whole sectors with one small read each where it would walk their
+    // records: finding the back of variable length records and scanning checksummed records past the last header
+    bool seal_sectors = false;
+    // in overwrite mode, asked about a record that only fits by dropping the records of the front sector; returning
+    // false rejects the record with ESP_ERR_NO_MEM and keeps the buffered ones, so records of low priority don't
+    // evict older records of high priority while nobody reads them, staged records that are rejected are discarded
+    bool (*admit)(const void* record, size_t len, void* arg) = NULL;
+    void* admit_arg = NULL;
+    // keep a second copy of the circular buffer on this storage, of the same size and sector size, which must
+    // outlive the circular buffer: every write and erase goes to both copies, headers included so they share one
+    // sequence, a read falls back to the mirror when the storage fails it or with record_crc when a record is
+    // corrupted, and init() first rewrites the sectors of the older copy that differ from the copy with the newer header
+    const cb_storage* mirror = NULL;
+};
+
+// counters of a circular buffer built with CB_STATS defined, see get_stats()
+struct cb_stats {
+    // records pushed, records popped or deleted from the front and records dropped from the front by overwrite
+    uint64_t pushes;
+    uint64_t pops;
+    uint64_t dropped;
+    // records rejected by the admit callback of the configuration
+    uint64_t rejected;
+    // header commits and erased sectors, header slots included
+    uint64_t commits;
+    uint64_t erases;
+    // bytes passed to storage writes and reads, reads through a mapping included
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    // microseconds spent in storage reads, writes and erases, in total and in the longest call
+    uint64_t flash_us;
+    uint32_t flash_max_us;
+};
+
+// reader streaming records with read_chunk(), see get_cursor()
+struct cb_cursor {
+    // position of the next record to read and number of records read since the front
+    size_t pos;
+    size_t records;
+    // front the cursor started from, the cursor can't be used once the front moved other than through ack()
+    size_t front;
+    uint32_t front_lap;
+};
 
 class CircularBuffer {
     public:
+        CircularBuffer() = default;
+        CircularBuffer(const CircularBuffer&) = delete;
+        CircularBuffer& operator=(const CircularBuffer&) = delete;
+        ~CircularBuffer();
         esp_err_t init(char* partition_name, size_t record_size, bool overwrite = false, bool recovery_mode = false);
+        esp_err_t init(char* partition_name, size_t record_size, const cb_config& config);
+        esp_err_t init(const cb_storage& storage, size_t record_size, const cb_config& config = cb_config());
         esp_err_t push_back(void* src);
+        esp_err_t push_back(const void* src, size_t len);
+        esp_err_t push_back_n(const void* src, size_t count);
+        esp_err_t push_back_async(const void* src, uint32_t timeout_ms = 0);
+        esp_err_t push_back_async(const void* src, size_t len, uint32_t timeout_ms);
+        esp_err_t flush_and_wait(uint32_t timeout_ms = CB_WAIT_FOREVER);
         esp_err_t peek_front(void* dest);
+        esp_err_t peek_front(void* dest, size_t max, size_t* len);
+        esp_err_t peek_front_ptr(const void** dest, size_t* len = NULL);
         esp_err_t pop_front(void* dest);
+        esp_err_t pop_front(void* dest, size_t max, size_t* len);
+        esp_err_t pop_front_n(void* dest, size_t max, size_t* out);
+        esp_err_t read_at(size_t index, void* dest);
+        esp_err_t get_cursor(cb_cursor* cursor);
+        esp_err_t read_chunk(void* dest, size_t max, cb_cursor* cursor, size_t* len);
+        esp_err_t ack(cb_cursor* cursor);
+        esp_err_t for_each(bool (*visit)(const void* record, size_t len, void* arg), void* arg);
+        esp_err_t seek_time(uint64_t time, size_t* index);
+        esp_err_t aggregate(size_t first, size_t count, void* result);
         esp_err_t delete_front();
+        esp_err_t delete_front_n(size_t count);
+        esp_err_t clear();
+        esp_err_t flush();
+        esp_err_t erase_ahead();
         uint32_t get_record_num();
         size_t get_max_records();
+        esp_err_t get_stats(cb_stats* stats);
+        void reset_stats();
     private:
         size_t front;
+        size_t back;
         size_t record_size;
         size_t record_num;
         uint32_t sequence;
-        size_t records_in_sec();
-        wl_handle_t wl_handle;
+        cb_storage storage;
+        esp_err_t flash_read(size_t addr, void* dest, size_t len);
+        esp_err_t flash_write(size_t addr, const void* src, size_t len);
+        esp_err_t flash_erase(size_t addr, size_t len);
         size_t secs_for_one_header();
         size_t secs_for_header();
         esp_err_t write_header();
-        uint32_t sec_num();
-        size_t header_offset();
+        esp_err_t release_secs(size_t from);
+        esp_err_t read_header_slot(uint32_t slot, cb_header* newest, bool* found, bool* torn, size_t* next_free);
+        void scan_slot(const uint8_t* entries, size_t len, size_t entry_size, bool (*decode)(const uint8_t* entry, cb_header* header),
+                       cb_header* newest, bool* found, bool* torn, size_t* next_free);
+        esp_err_t check_layout(const cb_header* header);
+        esp_err_t recover_next_record();
+        void load_geometry();
+        size_t sec_index(size_t pos);
+        size_t sec_offset(size_t pos);
+        size_t next_sec(size_t pos);
+        size_t ring_add(size_t pos, size_t len);
         size_t get_back();
+        size_t position_of(size_t index);
+        esp_err_t read_uncached(size_t pos, void* dest, size_t len);
+        esp_err_t map_sec(size_t sec, uint8_t* buffer, const uint8_t** data);
+        bool mapped_span(size_t pos, size_t len);
+        bool frame_valid(size_t pos, const uint8_t* frame, size_t len);
+        uint64_t time_of(const void* record);
+        esp_err_t check_times(const void* src, size_t count);
+        void index_time(size_t pos, const void* record);
+        esp_err_t build_time_index();
+        esp_err_t read_time(size_t pos, uint8_t* sector, size_t* loaded, uint64_t* time);
+        esp_err_t fold_back(size_t pos, const void* src, size_t count);
+        esp_err_t load_back_state();
+        bool len_ok(size_t len);
+        size_t pack(const uint8_t* src, const uint8_t* ref, uint8_t* dest);
+        bool unpack(const uint8_t* src, size_t len, const uint8_t* ref, uint8_t* dest);
+        esp_err_t unpack_to(size_t pos, uint8_t* ref);
+        esp_err_t unpack_front(const uint8_t* src, size_t len, void* dest);
+        esp_err_t load_refs();
+        esp_err_t reserve_back(const void* record, size_t len);
+        esp_err_t reserve_span(size_t len, const void* record, size_t record_len);
+        esp_err_t admitted(const void* record, size_t len);
+        esp_err_t reconcile();
+        bool mirror_frame(size_t pos, uint8_t* frame, size_t len);
+        esp_err_t check_mirrored(size_t pos, void* data, size_t len);
+        esp_err_t erase_sec(size_t sec);
+        esp_err_t prepare_sec(size_t sec);
+        size_t advance(size_t pos, size_t count);
+        size_t next_record(size_t pos, size_t len);
+        size_t payload(size_t pos);
+        esp_err_t record_at(size_t* pos, size_t* len);
+        size_t records_to_sec_end(size_t pos);
+        esp_err_t walk_back();
+        size_t free_records();
+        esp_err_t init_cache(const cb_config& config);
+        esp_err_t flush_cache();
+        esp_err_t flush_pending();
+        esp_err_t write_data(size_t pos, const void* src, size_t len);
+        esp_err_t read_data(size_t pos, void* dest, size_t len);
+        esp_err_t write_span(size_t pos, const void* src, size_t len);
+        esp_err_t read_span(size_t pos, void* dest, size_t len);
+        esp_err_t cached_data(size_t pos, const void** src);
+        esp_err_t front_cached(size_t pos, const void** src);
+        esp_err_t scan_records();
+        esp_err_t repair_back();
+        esp_err_t seal_sec(size_t sec);
+        esp_err_t read_seal(size_t sec, uint32_t* records);
+        esp_err_t count_back_records();
+        void set_front(size_t pos);
+        uint32_t lap_of(size_t pos);
+        esp_err_t check_record(size_t pos, const void* data, size_t len);
+        size_t build_frame(uint8_t* frame, const void* src, size_t len, uint32_t seed);
+        esp_err_t pushed(size_t count);
+        esp_err_t deleted(size_t count);
+        bool checkpoint_due();
+        esp_err_t start_async(const cb_config& config);
+        void stop_async();
+        static void flush_task(void* self);
+        void drain_stage();
+        esp_err_t write_staged(size_t start, size_t count, size_t* written);
+#ifdef CB_STATS
+        void count_flash(int64_t start, uint64_t* counter, uint64_t amount);
+#endif
+        // geometry cached by init()
+        size_t sec_size;
+        uint32_t sec_count;
+        size_t sec_records;
+        // bytes of a sector available to records, the aggregate footer takes the rest
+        size_t sec_space;
+        size_t slot_size;
+        size_t data_offset;
+        size_t ring_size;
+        size_t frame_size;
+        uint8_t sec_shift;
+        bool sec_pow2;
         bool overwrite = false;
-};
\ No newline at end of file
+        bool (*admit)(const void* record, size_t len, void* arg) = NULL;
+        void* admit_arg = NULL;
+        bool journal = false;
+        bool variable_length = false;
+        bool span_sectors = false;
+        bool record_crc = false;
+        // layout bits stamped into every header
+        uint8_t layout = 0;
+        uint32_t journal_slot = 0;
+        size_t journal_pos = 0;
+        // ahead_count sectors starting at ahead_start are erased and next to be entered by the back
+        uint32_t ahead_target = 0;
+        size_t ahead_start = 0;
+        uint32_t ahead_count = 0;
+        // sector caches, back_cache_sec and front_cache_sec are sector starts relative to the data area
+        uint8_t* back_cache = NULL;
+        uint8_t* front_cache = NULL;
+        size_t back_cache_sec = 0;
+        size_t front_cache_sec = 0;
+        bool back_cache_valid = false;
+        bool front_cache_valid = false;
+        size_t pending_start = 0;
+        size_t pending_end = 0;
+        size_t pending_records = 0;
+        size_t flush_records = 0;
+        size_t flush_bytes = 0;
+        bool header_dirty = false;
+        // record checksums and deferred header commits
+        uint8_t* frame_buf = NULL;
+        size_t scratch_size = 0;
+        uint32_t front_lap = 0;
+        size_t committed_front = 0;
+        size_t uncommitted = 0;
+        uint32_t checkpoint_records = 0;
+        uint32_t checkpoint_ms = 0;
+        int64_t last_commit_ms = 0;
+        // time series mode, time_index has one entry per data sector and is guarded by commit_lock
+        uint8_t timestamp_size = 0;
+        cb_sector_times* time_index = NULL;
+        uint64_t last_time = 0;
+        // aggregate footers, back_state summarizes the records written to the back sector so far
+        const cb_aggregator* aggregator = NULL;
+        size_t footer_size = 0;
+        uint8_t* back_state = NULL;
+        uint8_t* footer_buf = NULL;
+        // second copy of the storage, mirror_buf holds a frame read from it
+        cb_storage mirror_storage = {};
+        bool mirrored = false;
+        uint8_t* mirror_buf = NULL;
+        // sector seals, back_sec_records counts the records pushed to the back sector so far
+        size_t seal_size = 0;
+        uint32_t back_sec_records = 0;
+        // record compression, back_ref is the last record pushed to the back sector; at the front prev_ref is the
+        // record before prev_next and last_ref the one last decoded, which precedes last_next
+        uint8_t compress_width = 0;
+        uint8_t* pack_buf = NULL;
+        uint8_t* unpack_buf = NULL;
+        uint8_t* back_ref = NULL;
+        uint8_t* prev_ref = NULL;
+        uint8_t* last_ref = NULL;
+        size_t prev_next = 0;
+        size_t last_next = 0;
+        bool prev_valid = false;
+        bool last_valid = false;
+        // api_lock serializes every call in CB_LOCK_MUTEX mode; in CB_LOCK_SPSC mode front_lock is held by
+        // the consumer and commit_lock guards record_num, the front seen by the producer, the back sector
+        // cache and the header
+        CbMutex api_mutex;
+        CbMutex front_mutex;
+        CbMutex commit_mutex;
+        CbMutex* api_lock = NULL;
+        CbMutex* front_lock = NULL;
+        CbMutex* commit_lock = NULL;
+        // staging ring of push_back_async(), guarded by stage_mutex
+        uint8_t* stage = NULL;
+        uint16_t* stage_len = NULL;
+        size_t stage_cap = 0;
+        size_t stage_head = 0;
+        size_t stage_count = 0;
+        bool stage_stop = false;
+        bool stage_flush = false;
+        esp_err_t stage_err = ESP_OK;
+        CbMutex stage_mutex;
+        CbSemaphore stage_data;
+        CbSemaphore stage_space;
+        CbSemaphore stage_drained;
+        CbTask flusher;
+#ifdef CB_STATS
+        // the counters of records are guarded by commit_lock, stats_lock guards the counters of storage calls
+        // which the producer and the consumer make without it in CB_LOCK_SPSC mode
+        cb_stats stats = {};
+        CbMutex stats_mutex;
+        CbMutex* stats_lock = NULL;
+#endif
+};
@@ -1,8 +0,0 @@
-#pragma once
-
-#include <stdint.h>
-#include <stddef.h>
-
-void crc32_init();
-
-uint32_t esp_crc32_le(uint32_t crc, const uint8_t *buf, size_t len);
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "circular_buffer.h"
 #include <cstdio>
 #include <cstring>
+#include <thread>
 
-#include "esp_crc.h"
+#include "cb_crc.h"
+#include "cb_pool.h"
+#include "cb_typed.h"
 
 #define ESP_ERROR_CHECK(x) do {                                         \
         esp_err_t err_rc_ = (x);                                        \
@@ -10,8 +13,6 @@
     } while(0)
 
 int main() {
-    crc32_init();
-
     wl_handle_t handle;
     esp_partition_t part = { .label = "mock" };
     ESP_ERROR_CHECK(wl_mount(&part, &handle));
@@ -42,6 +43,879 @@ int main() {
         }
     }
 
+    // Journaled header: push past one header slot worth of commits
+    CircularBuffer journaled;
+    cb_config config;
+    config.overwrite = true;
+    config.journal = true;
+    ESP_ERROR_CHECK(journaled.init((char*)"mock", RECORD_SIZE, config));
+
+    int failures = 0;
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(journaled.push_back(input));
+    }
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (journaled.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    printf("Journaled records: %u, failures: %d\n", journaled.get_record_num(), failures);
+
+    // Batched push/pop across sector boundaries
+    CircularBuffer batched;
+    ESP_ERROR_CHECK(batched.init((char*)"mock", RECORD_SIZE));
+
+    static uint8_t batch[700 * RECORD_SIZE];
+    for (int i = 0; i < 700; i++) { memset(batch + i * RECORD_SIZE, i, RECORD_SIZE); }
+    ESP_ERROR_CHECK(batched.push_back_n(batch, 700));
+    memset(batch, 0, sizeof(batch));
+    size_t popped = 0, total = 0;
+    while (batched.pop_front_n(batch + total * RECORD_SIZE, 300, &popped) == ESP_OK) { total += popped; }
+    for (size_t i = 0; i < total; i++) {
+        memset(input, (int)i, RECORD_SIZE);
+        if (memcmp(input, batch + i * RECORD_SIZE, RECORD_SIZE) != 0) { failures++; }
+    }
+    if (total != 700) { failures++; }
+    printf("Batched records: %zu, failures: %d\n", total, failures);
+
+    // Cached back sector: peek straight from RAM, flush explicitly
+    CircularBuffer cached;
+    cb_config cache_config;
+    cache_config.cache_back = true;
+    cache_config.cache_front = true;
+    ESP_ERROR_CHECK(cached.init((char*)"mock", RECORD_SIZE, cache_config));
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(cached.push_back(input));
+    }
+    ESP_ERROR_CHECK(cached.flush());
+    for (int i = 0; i < 300; i++) {
+        const void* record;
+        memset(input, i, RECORD_SIZE);
+        if (cached.peek_front_ptr(&record) != ESP_OK || memcmp(input, record, RECORD_SIZE) != 0) { failures++; }
+        ESP_ERROR_CHECK(cached.delete_front());
+    }
+    printf("Cached records: %u, failures: %d\n", cached.get_record_num(), failures);
+
+    // Variable length records packed back to back
+    CircularBuffer variable;
+    cb_config variable_config;
+    variable_config.variable_length = true;
+    ESP_ERROR_CHECK(variable.init((char*)"mock", 2000, variable_config));
+    for (int i = 0; i < 50; i++) {
+        memset(batch, i, i * 31);
+        ESP_ERROR_CHECK(variable.push_back(batch, i * 31));
+    }
+    for (int i = 0; i < 50; i++) {
+        static uint8_t expected[50 * 31];
+        size_t len;
+        memset(expected, i, i * 31);
+        if (variable.pop_front(batch, sizeof(batch), &len) != ESP_OK || len != (size_t)i * 31 || memcmp(expected, batch, len) != 0) { failures++; }
+    }
+    printf("Variable length records: %u, failures: %d\n", variable.get_record_num(), failures);
+
+    // Records crossing sector boundaries
+    CircularBuffer spanning;
+    cb_config span_config;
+    span_config.span_sectors = true;
+    const size_t SPAN_RECORD_SIZE = 600;
+    ESP_ERROR_CHECK(spanning.init((char*)"mock", SPAN_RECORD_SIZE, span_config));
+    for (int i = 0; i < 20; i++) {
+        memset(batch, i, SPAN_RECORD_SIZE);
+        ESP_ERROR_CHECK(spanning.push_back(batch));
+    }
+    for (int i = 0; i < 20; i++) {
+        static uint8_t expected[SPAN_RECORD_SIZE];
+        memset(expected, i, SPAN_RECORD_SIZE);
+        if (spanning.pop_front(batch) != ESP_OK || memcmp(expected, batch, SPAN_RECORD_SIZE) != 0) { failures++; }
+    }
+    // there is room for the capacity wherever the front stands in its sector
+    memset(batch, 1, SPAN_RECORD_SIZE);
+    for (int lap = 0; lap < 5; lap++) {
+        while (spanning.get_record_num() < spanning.get_max_records()) {
+            if (spanning.push_back(batch) != ESP_OK) {
+                failures++;
+                break;
+            }
+        }
+        for (int i = 0; i < 97; i++) { ESP_ERROR_CHECK(spanning.delete_front()); }
+    }
+    ESP_ERROR_CHECK(spanning.clear());
+    printf("Spanning records: %u of %zu, failures: %d\n", spanning.get_record_num(), spanning.get_max_records(), failures);
+
+    // Checksummed records with deferred header commits, the first record is corrupted on flash
+    CircularBuffer checked;
+    cb_config crc_config;
+    crc_config.record_crc = true;
+    crc_config.checkpoint_records = 8;
+    ESP_ERROR_CHECK(checked.init((char*)"mock", RECORD_SIZE, crc_config));
+    for (int i = 0; i < 20; i++) {
+        memset(input, i + 1, RECORD_SIZE);
+        ESP_ERROR_CHECK(checked.push_back(input));
+    }
+    uint8_t zero = 0;
+    ESP_ERROR_CHECK(wl_write(handle, 2 * wl_sector_size(handle), &zero, 1));
+    if (checked.peek_front(output) != ESP_ERR_INVALID_CRC) { failures++; }
+    ESP_ERROR_CHECK(checked.delete_front());
+    for (int i = 1; i < 20; i++) {
+        memset(input, i + 1, RECORD_SIZE);
+        if (checked.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    // batches stop before a corrupted record, which is the 401st from the front 20 records into the first sector
+    for (int i = 0; i < 700; i++) { memset(batch + i * RECORD_SIZE, i, RECORD_SIZE); }
+    ESP_ERROR_CHECK(checked.push_back_n(batch, 700));
+    size_t checked_frames = wl_sector_size(handle) / (RECORD_SIZE + sizeof(uint32_t));
+    ESP_ERROR_CHECK(wl_write(handle, (2 + 420 / checked_frames) * wl_sector_size(handle) + 420 % checked_frames * (RECORD_SIZE + sizeof(uint32_t)), &zero, 1));
+    memset(batch, 0, sizeof(batch));
+    total = 0;
+    if (checked.pop_front_n(batch, 300, &popped) != ESP_OK || popped != 300) { failures++; }
+    total += popped;
+    if (checked.pop_front_n(batch + total * RECORD_SIZE, 300, &popped) != ESP_OK || popped != 100) { failures++; }
+    total += popped;
+    if (checked.pop_front_n(batch + total * RECORD_SIZE, 300, &popped) != ESP_ERR_INVALID_CRC || popped != 0) { failures++; }
+    ESP_ERROR_CHECK(checked.delete_front());
+    total++;
+    while (checked.pop_front_n(batch + total * RECORD_SIZE, 300, &popped) == ESP_OK) { total += popped; }
+    for (size_t i = 0; i < total; i++) {
+        memset(input, (int)i, RECORD_SIZE);
+        if (i != 400 && memcmp(input, batch + i * RECORD_SIZE, RECORD_SIZE) != 0) { failures++; }
+    }
+    if (total != 700) { failures++; }
+    ESP_ERROR_CHECK(checked.flush());
+    printf("Checksummed records: %u, failures: %d\n", checked.get_record_num(), failures);
+
+    // One task pushing while another pops, records must come out complete and in order
+    CircularBuffer shared;
+    cb_config spsc_config;
+    spsc_config.locking = CB_LOCK_SPSC;
+    spsc_config.cache_front = true;
+    ESP_ERROR_CHECK(shared.init((char*)"mock", RECORD_SIZE, spsc_config));
+    const int SHARED_RECORDS = 500;
+    std::thread producer([&shared]() {
+        uint8_t record[RECORD_SIZE];
+        for (int i = 0; i < SHARED_RECORDS; i++) {
+            memset(record, i, RECORD_SIZE);
+            while (shared.push_back(record) == ESP_ERR_NO_MEM) { std::this_thread::yield(); }
+        }
+    });
+    for (int i = 0; i < SHARED_RECORDS;) {
+        if (shared.pop_front(output) != ESP_OK) {
+            std::this_thread::yield();
+            continue;
+        }
+        memset(input, i++, RECORD_SIZE);
+        if (memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    producer.join();
+    printf("Shared records: %u, failures: %d\n", shared.get_record_num(), failures);
+
+    // Two producers behind the mutex, each one's records stay in order
+    CircularBuffer locked;
+    cb_config mutex_config;
+    mutex_config.locking = CB_LOCK_MUTEX;
+    ESP_ERROR_CHECK(locked.init((char*)"mock", RECORD_SIZE, mutex_config));
+    std::thread producers[2];
+    for (int p = 0; p < 2; p++) {
+        producers[p] = std::thread([&locked, p]() {
+            uint8_t record[RECORD_SIZE];
+            for (int i = 0; i < SHARED_RECORDS / 2; i++) {
+                memset(record, i, RECORD_SIZE);
+                record[0] = p;
+                ESP_ERROR_CHECK(locked.push_back(record));
+            }
+        });
+    }
+    for (int p = 0; p < 2; p++) { producers[p].join(); }
+    int next[2] = { 0, 0 };
+    while (locked.pop_front(output) == ESP_OK) {
+        if (output[0] > 1 || output[1] != next[output[0]]++) { failures++; }
+    }
+    if (next[0] + next[1] != SHARED_RECORDS) { failures++; }
+    printf("Locked records: %u, failures: %d\n", locked.get_record_num(), failures);
+
+    // Records staged in RAM and written by the flush task
+    CircularBuffer staged;
+    cb_config async_config;
+    async_config.async_records = 32;
+    ESP_ERROR_CHECK(staged.init((char*)"mock", RECORD_SIZE, async_config));
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (staged.push_back_async(input, CB_WAIT_FOREVER) != ESP_OK) { failures++; }
+    }
+    if (staged.flush_and_wait() != ESP_OK || staged.get_record_num() != 300) { failures++; }
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (staged.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    printf("Staged records: %u, failures: %d\n", staged.get_record_num(), failures);
+
+    // Sectors past the back erased ahead of time, pushes entering them must not erase again
+    CircularBuffer ahead;
+    cb_config ahead_config;
+    ahead_config.erase_ahead = 2;
+    ESP_ERROR_CHECK(ahead.init((char*)"mock", RECORD_SIZE, ahead_config));
+    for (int i = 0; i < 300; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(ahead.push_back(input));
+    }
+    size_t sec_size = wl_sector_size(handle);
+    static uint8_t sector[4096];
+    memset(sector, 0, sizeof(sector));
+    ESP_ERROR_CHECK(wl_write(handle, 4 * sec_size, sector, sizeof(sector)));
+    ESP_ERROR_CHECK(wl_write(handle, 5 * sec_size, sector, sizeof(sector)));
+    ESP_ERROR_CHECK(ahead.erase_ahead());
+    ESP_ERROR_CHECK(wl_read(handle, 5 * sec_size, sector, sizeof(sector)));
+    if (sector[0] != 0xFF || sector[sizeof(sector) - 1] != 0xFF) { failures++; }
+    for (int i = 300; i < 800; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(ahead.push_back(input));
+    }
+    for (int i = 0; i < 800; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (ahead.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    printf("Erased ahead records: %u, failures: %d\n", ahead.get_record_num(), failures);
+
+    // Reading records in place by index and by walking them, nothing is deleted
+    CircularBuffer browsed;
+    cb_config browse_config;
+    browse_config.cache_back = true;
+    browse_config.record_crc = true;
+    ESP_ERROR_CHECK(browsed.init((char*)"mock", RECORD_SIZE, browse_config));
+    for (int i = 0; i < 600; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(browsed.push_back(input));
+    }
+    ESP_ERROR_CHECK(browsed.delete_front());
+    for (int i : { 0, 250, 598 }) {
+        memset(input, i + 1, RECORD_SIZE);
+        if (browsed.read_at(i, output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    if (browsed.read_at(599, output) != ESP_ERR_NOT_FOUND) { failures++; }
+    struct walk { int next; int failures; } fixed_walk = { 1, 0 };
+    ESP_ERROR_CHECK(browsed.for_each([](const void* record, size_t len, void* arg) {
+        walk* state = (walk*)arg;
+        if (len != RECORD_SIZE || ((const uint8_t*)record)[RECORD_SIZE - 1] != (uint8_t)state->next++) { state->failures++; }
+        return true;
+    }, &fixed_walk));
+    if (fixed_walk.next != 600 || browsed.get_record_num() != 599) { failures += fixed_walk.failures + 1; }
+
+    CircularBuffer browsed_variable;
+    ESP_ERROR_CHECK(browsed_variable.init((char*)"mock", 2000, variable_config));
+    for (int i = 0; i < 50; i++) {
+        memset(batch, i, i * 31);
+        ESP_ERROR_CHECK(browsed_variable.push_back(batch, i * 31));
+    }
+    walk variable_walk = { 0, 0 };
+    ESP_ERROR_CHECK(browsed_variable.for_each([](const void* record, size_t len, void* arg) {
+        walk* state = (walk*)arg;
+        int i = state->next++;
+        if (len != (size_t)i * 31 || (len > 0 && ((const uint8_t*)record)[len - 1] != i)) { state->failures++; }
+        return i < 39;
+    }, &variable_walk));
+    if (variable_walk.next != 40 || variable_walk.failures != 0) { failures++; }
+    printf("Browsed records: %u, failures: %d\n", browsed.get_record_num(), failures);
+
+    // Acknowledging many records at once and clearing the buffer
+    CircularBuffer acked;
+    ESP_ERROR_CHECK(acked.init((char*)"mock", RECORD_SIZE));
+    for (int i = 0; i < 1000; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(acked.push_back(input));
+    }
+    if (acked.delete_front_n(1001) != ESP_ERR_NOT_FOUND || acked.get_record_num() != 1000) { failures++; }
+    ESP_ERROR_CHECK(acked.delete_front_n(700));
+    memset(input, 700, RECORD_SIZE);
+    if (acked.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    ESP_ERROR_CHECK(acked.clear());
+    if (acked.get_record_num() != 0 || acked.pop_front(output) != ESP_ERR_NOT_FOUND) { failures++; }
+    memset(input, 0xA5, RECORD_SIZE);
+    ESP_ERROR_CHECK(acked.push_back(input));
+    if (acked.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+
+    CircularBuffer acked_variable;
+    ESP_ERROR_CHECK(acked_variable.init((char*)"mock", 2000, variable_config));
+    for (int i = 0; i < 50; i++) {
+        memset(batch, i, i * 31);
+        ESP_ERROR_CHECK(acked_variable.push_back(batch, i * 31));
+    }
+    ESP_ERROR_CHECK(acked_variable.delete_front_n(45));
+    size_t acked_len;
+    if (acked_variable.pop_front(batch, sizeof(batch), &acked_len) != ESP_OK || acked_len != 45 * 31 || batch[0] != 45) { failures++; }
+    printf("Acknowledged records: %u, failures: %d\n", acked_variable.get_record_num(), failures);
+
+    // Time series records located by timestamp
+    CircularBuffer series;
+    cb_config series_config;
+    series_config.timestamp_size = 4;
+    ESP_ERROR_CHECK(series.init((char*)"mock", RECORD_SIZE, series_config));
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint32_t time = 1000 + i * 10;
+        memset(input, i, RECORD_SIZE);
+        memcpy(input, &time, sizeof(time));
+        ESP_ERROR_CHECK(series.push_back(input));
+    }
+    ESP_ERROR_CHECK(series.delete_front_n(100));
+    size_t found;
+    if (series.seek_time(1000 + 500 * 10, &found) != ESP_OK || found != 400) { failures++; }
+    if (series.seek_time(1000 + 500 * 10 - 5, &found) != ESP_OK || found != 400) { failures++; }
+    if (series.seek_time(0, &found) != ESP_OK || found != 0) { failures++; }
+    if (series.seek_time(1000 + 1000 * 10, &found) != ESP_ERR_NOT_FOUND) { failures++; }
+    uint32_t stale = 1000;
+    memcpy(input, &stale, sizeof(stale));
+    if (series.push_back(input) != ESP_ERR_INVALID_ARG || series.get_record_num() != 900) { failures++; }
+    if (series.read_at(400, output) != ESP_OK || output[RECORD_SIZE - 1] != (uint8_t)500) { failures++; }
+    printf("Time series records: %u, failures: %d\n", series.get_record_num(), failures);
+
+    // Sum and maximum of a field over ranges, whole sectors are summarized by their footers
+    struct summary { uint64_t sum; uint32_t max; uint32_t count; };
+    cb_aggregator summarizer = {
+        sizeof(summary),
+        [](void* state) { memset(state, 0, sizeof(summary)); },
+        [](void* state, const void* record) {
+            summary* s = (summary*)state;
+            uint32_t value;
+            memcpy(&value, (const uint8_t*)record + 4, sizeof(value));
+            s->sum += value;
+            if (value > s->max) { s->max = value; }
+            s->count++;
+        },
+        [](void* state, const void* other) {
+            summary* s = (summary*)state;
+            const summary* o = (const summary*)other;
+            s->sum += o->sum;
+            if (o->max > s->max) { s->max = o->max; }
+            s->count += o->count;
+        },
+    };
+    CircularBuffer summarized;
+    cb_config summary_config;
+    summary_config.aggregator = &summarizer;
+    summary_config.cache_back = true;
+    ESP_ERROR_CHECK(summarized.init((char*)"mock", RECORD_SIZE, summary_config));
+    for (uint32_t i = 0; i < 2000; i++) {
+        uint32_t value = i * 7 % 1000;
+        memset(input, 0, RECORD_SIZE);
+        memcpy(input + 4, &value, sizeof(value));
+        ESP_ERROR_CHECK(summarized.push_back(input));
+    }
+    ESP_ERROR_CHECK(summarized.delete_front_n(100));
+    for (size_t range : { 0, 1, 250, 1900 }) {
+        size_t first = (1900 - range) / 2;
+        summary expected = { 0, 0, 0 }, result;
+        for (size_t i = first; i < first + range; i++) {
+            uint32_t value = (i + 100) * 7 % 1000;
+            expected.sum += value;
+            if (value > expected.max) { expected.max = value; }
+            expected.count++;
+        }
+        if (summarized.aggregate(first, range, &result) != ESP_OK || result.sum != expected.sum || result.max != expected.max ||
+            result.count != expected.count) { failures++; }
+    }
+    summary unused;
+    if (summarized.aggregate(1000, 901, &unused) != ESP_ERR_NOT_FOUND) { failures++; }
+    printf("Summarized records: %u, failures: %d\n", summarized.get_record_num(), failures);
+
+    // Slowly changing sensor readings take a few bytes each when compressed
+    CircularBuffer compressed;
+    cb_config compressed_config;
+    compressed_config.compress_width = 4;
+    compressed_config.cache_back = true;
+    ESP_ERROR_CHECK(compressed.init((char*)"mock", RECORD_SIZE, compressed_config));
+    auto reading = [](uint32_t i, uint8_t* record) {
+        uint32_t fields[4] = { 1000 + i * 10, 2000 + i / 8, (uint32_t)-(int32_t)(i % 5), 0xC0FFEE };
+        memcpy(record, fields, sizeof(fields));
+    };
+    uint32_t stored = 0;
+    while (true) {
+        reading(stored, input);
+        if (compressed.push_back(input) != ESP_OK) { break; }
+        stored++;
+    }
+    // uncompressed, every sector holds 256 records
+    if (stored < 2 * 256 * (wl_size(handle) / sec_size - 2)) { failures++; }
+    struct check { void (*reading)(uint32_t, uint8_t*); uint32_t next; int bad; } decoded = { reading, 0, 0 };
+    ESP_ERROR_CHECK(compressed.for_each([](const void* record, size_t len, void* arg) {
+        check* c = (check*)arg;
+        uint8_t expected[16];
+        c->reading(c->next++, expected);
+        if (len != sizeof(expected) || memcmp(record, expected, len) != 0) { c->bad++; }
+        return true;
+    }, &decoded));
+    if (decoded.bad != 0 || decoded.next != stored) { failures++; }
+    ESP_ERROR_CHECK(compressed.delete_front_n(1001));
+    for (uint32_t i = 1001; i < 1100; i++) {
+        reading(i, input);
+        if (compressed.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    printf("Compressed records: %u, failures: %d\n", stored, failures);
+
+    // Records kept in a RAM image with NOR semantics survive a new init() on the same image
+    static uint8_t image[32 * 4096];
+    memset(image, 0xFF, sizeof(image));
+    cb_storage ram;
+    ESP_ERROR_CHECK(cb_storage_ram(image, sizeof(image), 4096, &ram));
+    {
+        CircularBuffer in_ram;
+        ESP_ERROR_CHECK(in_ram.init(ram, RECORD_SIZE));
+        for (int i = 0; i < 500; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(in_ram.push_back(input));
+        }
+    }
+    CircularBuffer reopened;
+    ESP_ERROR_CHECK(reopened.init(ram, RECORD_SIZE));
+    if (reopened.get_record_num() != 500) { failures++; }
+    for (int i = 0; i < 500; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (reopened.pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    if (cb_storage_ram(image, 1000, 4096, &ram) != ESP_ERR_INVALID_SIZE) { failures++; }
+    printf("RAM records: %u, failures: %d\n", reopened.get_record_num(), failures);
+
+    // Pointers into mapped storage, also to records crossing sectors
+    memset(image, 0xFF, sizeof(image));
+    CircularBuffer mapped;
+    cb_config mapped_config;
+    mapped_config.span_sectors = true;
+    ESP_ERROR_CHECK(mapped.init(ram, 3000, mapped_config));
+    for (int i = 0; i < 3; i++) {
+        memset(batch, i, 3000);
+        ESP_ERROR_CHECK(mapped.push_back(batch));
+    }
+    ESP_ERROR_CHECK(mapped.delete_front());
+    const void* mapped_record;
+    if (mapped.peek_front_ptr(&mapped_record) != ESP_OK || (const uint8_t*)mapped_record < image ||
+        (const uint8_t*)mapped_record >= image + sizeof(image) || ((const uint8_t*)mapped_record)[2999] != 1) { failures++; }
+    struct span { const uint8_t* start; const uint8_t* end; int outside; } bounds = { image, image + sizeof(image), 0 };
+    ESP_ERROR_CHECK(mapped.for_each([](const void* record, size_t len, void* arg) {
+        span* b = (span*)arg;
+        if ((const uint8_t*)record < b->start || (const uint8_t*)record + len > b->end || len != 3000) { b->outside++; }
+        return true;
+    }, &bounds));
+    if (bounds.outside != 0) { failures++; }
+    printf("Mapped records: %u, failures: %d\n", mapped.get_record_num(), failures);
+
+    // Streams of a pool take sectors as they grow and give them back as they are drained
+    memset(image, 0xFF, sizeof(image));
+    uint32_t pooled = 0;
+    {
+        CbPool pool;
+        ESP_ERROR_CHECK(pool.init(ram, 3));
+        cb_storage telemetry_storage, events_storage;
+        ESP_ERROR_CHECK(pool.stream(0, &telemetry_storage));
+        ESP_ERROR_CHECK(pool.stream(1, &events_storage, 4));
+        CircularBuffer telemetry, events;
+        cb_config events_config;
+        events_config.overwrite = true;
+        ESP_ERROR_CHECK(telemetry.init(telemetry_storage, RECORD_SIZE));
+        ESP_ERROR_CHECK(events.init(events_storage, RECORD_SIZE, events_config));
+        for (int i = 0; i < 200; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(events.push_back(input));
+        }
+        while (true) {
+            memset(input, pooled, RECORD_SIZE);
+            if (telemetry.push_back(input) != ESP_OK) { break; }
+            pooled++;
+        }
+        if (pool.get_free_sectors() != 0 || pooled < 28 * (4080 / RECORD_SIZE)) { failures++; }
+    }
+    CbPool pool;
+    ESP_ERROR_CHECK(pool.init(ram, 3));
+    cb_storage pool_storage[3];
+    CircularBuffer streams[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        ESP_ERROR_CHECK(pool.stream(i, &pool_storage[i], i == 1 ? 4 : 0));
+        ESP_ERROR_CHECK(streams[i].init(pool_storage[i], RECORD_SIZE));
+    }
+    if (streams[0].get_record_num() != pooled || streams[1].get_record_num() != 200 || streams[2].get_record_num() != 0) { failures++; }
+    for (uint32_t i = 0; i < pooled; i++) {
+        memset(input, i, RECORD_SIZE);
+        if (streams[0].pop_front(output) != ESP_OK || memcmp(input, output, RECORD_SIZE) != 0) { failures++; }
+    }
+    // the front sectors of both streams are still held
+    if (pool.get_free_sectors() < 28) { failures++; }
+    for (int i = 0; i < 2000; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(streams[2].push_back(input));
+    }
+    if (streams[2].get_record_num() != 2000 || streams[1].pop_front(output) != ESP_OK || output[0] != 0) { failures++; }
+    // of two sectors claiming the same virtual sector the one with the newer tag is kept and the other is released
+    memset(image, 0xFF, sizeof(image));
+    {
+        CbPool claimed_pool;
+        cb_storage claimed_storage;
+        CircularBuffer claimed;
+        ESP_ERROR_CHECK(claimed_pool.init(ram, 1));
+        ESP_ERROR_CHECK(claimed_pool.stream(0, &claimed_storage));
+        ESP_ERROR_CHECK(claimed.init(claimed_storage, RECORD_SIZE));
+        memset(input, 1, RECORD_SIZE);
+        for (int i = 0; i < 10; i++) { ESP_ERROR_CHECK(claimed.push_back(input)); }
+    }
+    // the first data sector holds virtual sector 0, a copy with a newer tag and other records claims it too
+    memcpy(image + 5 * 4096, image + 2 * 4096, 4096);
+    cb_pool_tag* newer_tag = (cb_pool_tag*)(image + 5 * 4096);
+    newer_tag->sequence += 100;
+    newer_tag->crc = cb_crc32(0, (const uint8_t*)newer_tag, offsetof(struct cb_pool_tag, crc));
+    memset(image + 5 * 4096 + CB_POOL_TAG_SIZE, 2, RECORD_SIZE);
+    CbPool claimed_pool;
+    cb_storage claimed_storage;
+    CircularBuffer claimed;
+    ESP_ERROR_CHECK(claimed_pool.init(ram, 1));
+    if (claimed_pool.get_free_sectors() != 29 || image[2 * 4096 + offsetof(struct cb_pool_tag, live)] != 0) { failures++; }
+    ESP_ERROR_CHECK(claimed_pool.stream(0, &claimed_storage));
+    ESP_ERROR_CHECK(claimed.init(claimed_storage, RECORD_SIZE));
+    if (claimed.pop_front(output) != ESP_OK || output[0] != 2 || claimed.get_record_num() != 9) { failures++; }
+    printf("Pooled records: %u, failures: %d\n", pooled, failures);
+
+    // Counters of a full buffer dropping its front sector, every push and pop commits the header and so does
+    // the drop before the sector is erased
+    memset(image, 0xFF, sizeof(image));
+    CircularBuffer counted;
+    cb_config counted_config;
+    counted_config.overwrite = true;
+    ESP_ERROR_CHECK(counted.init(ram, RECORD_SIZE, counted_config));
+    counted.reset_stats();
+    cb_stats stats;
+    for (int i = 0; i < 30 * 256 + 1; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(counted.push_back(input));
+    }
+    for (int i = 0; i < 5; i++) { ESP_ERROR_CHECK(counted.pop_front(output)); }
+#ifdef CB_STATS
+    if (counted.get_stats(&stats) != ESP_OK || stats.pushes != 7681 || stats.pops != 5 || stats.dropped != 256 ||
+        stats.commits != 7687 || stats.erases != 7687 + 31 || stats.bytes_written != 7681 * RECORD_SIZE + 7687 * sizeof(cb_header) ||
+        stats.bytes_read < 5 * RECORD_SIZE || stats.flash_max_us > stats.flash_us) { failures++; }
+    counted.reset_stats();
+    if (counted.get_stats(&stats) != ESP_OK || stats.pushes != 0 || stats.erases != 0 || stats.flash_us != 0) { failures++; }
+#else
+    if (counted.get_stats(&stats) != ESP_ERR_NOT_SUPPORTED) { failures++; }
+#endif
+    printf("Counted records: %u, failures: %d\n", counted.get_record_num(), failures);
+
+    // Records passed by value with the geometry fixed at compile time
+    struct sensor_reading { uint32_t time; int16_t value; uint16_t flags; };
+    typedef TypedCircularBuffer<sensor_reading, 4096> readings_buffer;
+    static_assert(readings_buffer::records_per_sector() == 512 && readings_buffer::records_per_sector(true) == 341 &&
+                  readings_buffer::records_per_sector(false, 16, true) == 508, "geometry");
+    memset(image, 0xFF, sizeof(image));
+    readings_buffer readings;
+    ESP_ERROR_CHECK(readings.init(ram));
+    for (uint32_t i = 0; i < 1000; i++) { ESP_ERROR_CHECK(readings.push_back(sensor_reading{ i, (int16_t)(i * 3), 0 })); }
+    sensor_reading read_back;
+    if (readings.read_at(999, &read_back) != ESP_OK || read_back.time != 999 || readings.get_max_records() != 30 * 512) { failures++; }
+    for (uint32_t i = 0; i < 1000; i++) {
+        std::optional<sensor_reading> r = readings.pop_front();
+        if (!r || r->time != i || r->value != (int16_t)(i * 3)) { failures++; }
+    }
+    if (readings.pop_front()) { failures++; }
+    TypedCircularBuffer<sensor_reading, 512> mismatched;
+    if (mismatched.init(ram) != ESP_ERR_INVALID_SIZE) { failures++; }
+    // the geometry computed at compile time is the one the buffer lays out
+    readings_buffer checked_readings;
+    cb_config checked_readings_config;
+    checked_readings_config.record_crc = true;
+    checked_readings_config.seal_sectors = true;
+    memset(image, 0xFF, sizeof(image));
+    ESP_ERROR_CHECK(checked_readings.init(ram, checked_readings_config));
+    if (checked_readings.get_max_records() != 30 * readings_buffer::records_per_sector(true, 0, true)) { failures++; }
+    printf("Typed records: %u, failures: %d\n", readings.get_record_num(), failures);
+
+    // Sealed sectors are skipped by init() instead of walking their records, with and without checksums
+#ifdef CB_STATS
+    size_t walked_bytes[2] = { 0, 0 };
+#endif
+    uint32_t sealed_num = 0;
+    for (int sealed = 0; sealed < 2; sealed++) {
+        for (int checked = 0; checked < 2; checked++) {
+            memset(image, 0xFF, sizeof(image));
+            cb_config sealed_config;
+            sealed_config.variable_length = true;
+            sealed_config.journal = true;
+            sealed_config.seal_sectors = sealed;
+            sealed_config.record_crc = checked;
+            // with checksums no header is committed after init(), the next init() finds the records by scanning
+            sealed_config.checkpoint_records = 100000;
+            {
+                CircularBuffer writer;
+                ESP_ERROR_CHECK(writer.init(ram, 32, sealed_config));
+                for (int i = 0; i < 5000; i++) {
+                    memset(batch, i, 32);
+                    ESP_ERROR_CHECK(writer.push_back(batch, 1 + i % 32));
+                }
+            }
+            CircularBuffer walked;
+            ESP_ERROR_CHECK(walked.init(ram, 32, sealed_config));
+            sealed_num += walked.get_record_num();
+            if (walked.get_record_num() != 5000) { failures++; }
+#ifdef CB_STATS
+            cb_stats walked_stats;
+            ESP_ERROR_CHECK(walked.get_stats(&walked_stats));
+            walked_bytes[sealed] += walked_stats.bytes_read;
+#endif
+            size_t len;
+            for (int i = 0; i < 5000; i++) {
+                if (walked.pop_front(batch, 32, &len) != ESP_OK || len != (size_t)(1 + i % 32) || batch[len - 1] != (uint8_t)i) {
+                    failures++;
+                    break;
+                }
+            }
+        }
+    }
+#ifdef CB_STATS
+    if (walked_bytes[1] * 3 > walked_bytes[0]) { failures++; }
+#endif
+    printf("Sealed records: %u, failures: %d\n", sealed_num, failures);
+
+    // Records streamed in chunks as they are stored and deleted by acknowledging the cursor
+    static uint8_t chunk[1000];
+    uint32_t streamed = 0;
+    for (int variable = 0; variable < 2; variable++) {
+        for (int checked = 0; checked < 2; checked++) {
+            memset(image, 0xFF, sizeof(image));
+            cb_config chunked_config;
+            chunked_config.variable_length = variable;
+            chunked_config.record_crc = checked;
+            CircularBuffer chunked;
+            ESP_ERROR_CHECK(chunked.init(ram, 32, chunked_config));
+            for (int i = 0; i < 3000; i++) {
+                memset(batch, i, 32);
+                ESP_ERROR_CHECK(chunked.push_back(batch, variable ? 1 + i % 32 : 32));
+            }
+            cb_cursor cursor;
+            ESP_ERROR_CHECK(chunked.get_cursor(&cursor));
+            size_t len;
+            if (chunked.read_chunk(chunk, 2, &cursor, &len) != ESP_ERR_INVALID_SIZE || len != 0) { failures++; }
+            int next = 0;
+            for (int chunks = 1; chunked.read_chunk(chunk, sizeof(chunk), &cursor, &len) == ESP_OK; chunks++) {
+                for (size_t at = 0; at < len; next++) {
+                    uint16_t size = 32;
+                    if (variable) {
+                        memcpy(&size, chunk + at, sizeof(size));
+                        at += sizeof(size);
+                    }
+                    if (size != (variable ? 1 + next % 32 : 32) || chunk[at] != (uint8_t)next || chunk[at + size - 1] != (uint8_t)next) { failures++; }
+                    at += size + (checked ? sizeof(uint32_t) : 0);
+                }
+                if (chunks % 3 == 0) { ESP_ERROR_CHECK(chunked.ack(&cursor)); }
+            }
+            if (next != 3000) { failures++; }
+            ESP_ERROR_CHECK(chunked.ack(&cursor));
+            if (chunked.get_record_num() != 0) { failures++; }
+            // a cursor started before the front moved is refused
+            ESP_ERROR_CHECK(chunked.push_back(batch, 32));
+            ESP_ERROR_CHECK(chunked.push_back(batch, 32));
+            ESP_ERROR_CHECK(chunked.get_cursor(&cursor));
+            ESP_ERROR_CHECK(chunked.delete_front());
+            if (chunked.read_chunk(chunk, sizeof(chunk), &cursor, &len) != ESP_ERR_INVALID_STATE) { failures++; }
+            CircularBuffer reopened_chunked;
+            ESP_ERROR_CHECK(reopened_chunked.init(ram, 32, chunked_config));
+            streamed += reopened_chunked.get_record_num();
+            if (reopened_chunked.get_record_num() != 1) { failures++; }
+        }
+    }
+    printf("Chunked records: %u, failures: %d\n", streamed, failures);
+
+    // Once the buffer is full in overwrite mode, records the admit callback ranks low are rejected instead of evicting
+    uint32_t admitted_num = 0;
+    for (int spanning = 0; spanning < 2; spanning++) {
+        memset(image, 0xFF, sizeof(image));
+        cb_config admit_config;
+        admit_config.overwrite = true;
+        admit_config.span_sectors = spanning;
+        // the first byte of a record is its priority, records of priority 0 may never drop others
+        admit_config.admit = [](const void* record, size_t, void*) { return ((const uint8_t*)record)[0] != 0; };
+        CircularBuffer admitting;
+        ESP_ERROR_CHECK(admitting.init(ram, RECORD_SIZE, admit_config));
+        // a fresh buffer of records spanning sectors fills the whole ring, its capacity counts only the room it always has
+        uint32_t full = spanning ? (sizeof(image) - 2 * 4096) / RECORD_SIZE : admitting.get_max_records();
+        memset(input, 1, RECORD_SIZE);
+        for (uint32_t i = 0; i < full; i++) { ESP_ERROR_CHECK(admitting.push_back(input)); }
+        memset(input, 0, RECORD_SIZE);
+        for (int i = 0; i < 10; i++) {
+            if (admitting.push_back(input) != ESP_ERR_NO_MEM) { failures++; }
+        }
+        memset(batch, 0, 20 * RECORD_SIZE);
+        if (admitting.push_back_n(batch, 20) != ESP_ERR_NO_MEM || admitting.get_record_num() != full) { failures++; }
+        memset(input, 2, RECORD_SIZE);
+        ESP_ERROR_CHECK(admitting.push_back(input));
+        if (admitting.get_record_num() != full - 4096 / RECORD_SIZE + 1) { failures++; }
+#ifdef CB_STATS
+        cb_stats admit_stats;
+        if (admitting.get_stats(&admit_stats) != ESP_OK || admit_stats.rejected != 11) { failures++; }
+#endif
+        admitted_num += admitting.get_record_num();
+    }
+    printf("Admitted records: %u, failures: %d\n", admitted_num, failures);
+
+    // Mirrored records are read from whichever copy is intact and init() brings the older copy up to date
+    static uint8_t mirror_image[32 * 4096];
+    static uint8_t stale_image[32 * 4096];
+    memset(image, 0xFF, sizeof(image));
+    memset(mirror_image, 0xFF, sizeof(mirror_image));
+    cb_storage mirror_ram;
+    ESP_ERROR_CHECK(cb_storage_ram(mirror_image, sizeof(mirror_image), 4096, &mirror_ram));
+    cb_config mirror_config;
+    mirror_config.record_crc = true;
+    mirror_config.mirror = &mirror_ram;
+    {
+        CircularBuffer mirrored;
+        ESP_ERROR_CHECK(mirrored.init(ram, RECORD_SIZE, mirror_config));
+        for (int i = 0; i < 1000; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(mirrored.push_back(input));
+        }
+        if (memcmp(image, mirror_image, sizeof(image)) != 0) { failures++; }
+        // the first record follows the two header slots
+        image[2 * 4096] ^= 0x01;
+        if (mirrored.pop_front(output) != ESP_OK || output[0] != 0) { failures++; }
+        memcpy(stale_image, mirror_image, sizeof(mirror_image));
+        for (int i = 1000; i < 1010; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(mirrored.push_back(input));
+        }
+    }
+    // power was lost before the last writes reached the mirror
+    memcpy(mirror_image, stale_image, sizeof(mirror_image));
+    CircularBuffer reconciled;
+    ESP_ERROR_CHECK(reconciled.init(ram, RECORD_SIZE, mirror_config));
+    if (reconciled.get_record_num() != 1009 || memcmp(image, mirror_image, sizeof(image)) != 0) { failures++; }
+    // headers lost in the storage are taken from the mirror
+    memset(image, 0, 2 * 4096);
+    ESP_ERROR_CHECK(reconciled.init(ram, RECORD_SIZE, mirror_config));
+    if (reconciled.get_record_num() != 1009 || memcmp(image, mirror_image, sizeof(image)) != 0) { failures++; }
+    if (reconciled.pop_front(output) != ESP_OK || output[0] != 1) { failures++; }
+    uint32_t mirrored_num = reconciled.get_record_num();
+    cb_storage small_mirror;
+    ESP_ERROR_CHECK(cb_storage_ram(mirror_image, 16 * 4096, 4096, &small_mirror));
+    mirror_config.mirror = &small_mirror;
+    if (reconciled.init(ram, RECORD_SIZE, mirror_config) != ESP_ERR_INVALID_SIZE) { failures++; }
+    printf("Mirrored records: %u, failures: %d\n", mirrored_num, failures);
+
+    // Headers record the layout of the records and carry a version, images from before the version are still read
+    memset(image, 0xFF, sizeof(image));
+    uint32_t versioned_num = 0;
+    {
+        CircularBuffer versioned;
+        ESP_ERROR_CHECK(versioned.init(ram, RECORD_SIZE));
+        for (int i = 0; i < 100; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(versioned.push_back(input));
+        }
+    }
+    CircularBuffer relayout;
+    cb_config layout_config;
+    layout_config.variable_length = true;
+    if (relayout.init(ram, 2 * RECORD_SIZE) != ESP_ERR_INVALID_ARG || relayout.init(ram, RECORD_SIZE, layout_config) != ESP_ERR_INVALID_ARG) { failures++; }
+    // both slots rewritten in the format without a version, as shipped firmware laid it out on 32 bit targets:
+    // magic, front, record_num, sequence and a crc over them
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        uint32_t legacy[5] = { 0x5B15B1, 0, 100, 7 + slot, 0 };
+        legacy[4] = cb_crc32(0, (const uint8_t*)legacy, 4 * sizeof(uint32_t));
+        memset(image + slot * 4096, 0xFF, 4096);
+        memcpy(image + slot * 4096, legacy, sizeof(legacy));
+    }
+    ESP_ERROR_CHECK(relayout.init(ram, RECORD_SIZE));
+    versioned_num += relayout.get_record_num();
+    if (relayout.get_record_num() != 100 || relayout.pop_front(output) != ESP_OK || output[0] != 0) { failures++; }
+    // the next commits replace both legacy headers
+    ESP_ERROR_CHECK(relayout.push_back(input));
+    // a header of a newer format is refused rather than misread
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        cb_header future;
+        memcpy(&future, image + slot * 4096, sizeof(future));
+        future.version++;
+        future.crc = cb_crc32(0, (const uint8_t*)&future, offsetof(cb_header, crc));
+        memcpy(image + slot * 4096, &future, sizeof(future));
+    }
+    if (relayout.init(ram, RECORD_SIZE) != ESP_ERR_INVALID_VERSION) { failures++; }
+    printf("Versioned records: %u, failures: %d\n", versioned_num, failures);
+
+    // Timestamped records larger than a sector leave sectors in which no record starts
+    memset(image, 0xFF, sizeof(image));
+    cb_config spanning_series_config;
+    spanning_series_config.span_sectors = true;
+    spanning_series_config.timestamp_size = 8;
+    CircularBuffer spanning_series;
+    ESP_ERROR_CHECK(spanning_series.init(ram, 6000, spanning_series_config));
+    for (uint64_t i = 0; i < 15; i++) {
+        uint64_t time = 100 + 10 * i;
+        memset(batch, (int)i, 6000);
+        memcpy(batch, &time, sizeof(time));
+        ESP_ERROR_CHECK(spanning_series.push_back(batch, 6000));
+    }
+    for (size_t i = 0; i < 15; i++) {
+        if (spanning_series.seek_time(100 + 10 * i, &found) != ESP_OK || found != i) { failures++; }
+        if (spanning_series.seek_time(95 + 10 * i, &found) != ESP_OK || found != i) { failures++; }
+    }
+    if (spanning_series.seek_time(250, &found) != ESP_ERR_NOT_FOUND) { failures++; }
+    printf("Spanning time series records: %u, failures: %d\n", spanning_series.get_record_num(), failures);
+
+    // Records still pending in the back sector cache are written when the buffer is destroyed or initialized again
+    memset(image, 0xFF, sizeof(image));
+    cb_config cached_config;
+    cached_config.cache_back = true;
+    {
+        CircularBuffer cached;
+        ESP_ERROR_CHECK(cached.init(ram, RECORD_SIZE, cached_config));
+        for (int i = 0; i < 10; i++) {
+            memset(input, i, RECORD_SIZE);
+            ESP_ERROR_CHECK(cached.push_back(input));
+        }
+    }
+    CircularBuffer recached;
+    ESP_ERROR_CHECK(recached.init(ram, RECORD_SIZE, cached_config));
+    if (recached.get_record_num() != 10) { failures++; }
+    for (int i = 10; i < 15; i++) {
+        memset(input, i, RECORD_SIZE);
+        ESP_ERROR_CHECK(recached.push_back(input));
+    }
+    ESP_ERROR_CHECK(recached.init(ram, RECORD_SIZE, cached_config));
+    if (recached.get_record_num() != 15 || recached.read_at(14, output) != ESP_OK || output[0] != 14) { failures++; }
+    printf("Pending records: %u, failures: %d\n", recached.get_record_num(), failures);
+
+    // A footer left from an earlier lap of a sector is not taken for the summary of its new records
+    memset(image, 0xFF, sizeof(image));
+    cb_config lapped_config;
+    lapped_config.aggregator = &summarizer;
+    lapped_config.overwrite = true;
+    CircularBuffer lapped;
+    ESP_ERROR_CHECK(lapped.init(ram, RECORD_SIZE, lapped_config));
+    size_t lap_records = lapped.get_max_records();
+    size_t sec_records = lap_records / 30;
+    // the footer ends the first data sector, which follows the two header slots
+    uint8_t stale_footer[sizeof(summary) + sizeof(uint32_t)];
+    uint8_t* first_footer = image + 3 * 4096 - sizeof(stale_footer);
+    for (size_t i = 0; i < lap_records + sec_records; i++) {
+        uint32_t value = i < lap_records ? 1 : 2;
+        memset(input, 0, RECORD_SIZE);
+        memcpy(input + 4, &value, sizeof(value));
+        ESP_ERROR_CHECK(lapped.push_back(input));
+        if (i == sec_records - 1) { memcpy(stale_footer, first_footer, sizeof(stale_footer)); }
+    }
+    memcpy(first_footer, stale_footer, sizeof(stale_footer));
+    summary lapped_summary;
+    if (lapped.aggregate(lap_records - sec_records, sec_records, &lapped_summary) != ESP_OK || lapped_summary.sum != 2 * sec_records) { failures++; }
+    printf("Lapped summaries: %u, failures: %d\n", lapped.get_record_num(), failures);
+
+    // Checksums match a bitwise CRC-32 for every length and alignment, and chain across calls
+    static uint8_t pattern[256];
+    for (size_t i = 0; i < sizeof(pattern); i++) { pattern[i] = (uint8_t)(i * 167 + 13); }
+    if (cb_crc32(0, (const uint8_t*)"123456789", 9) != 0xCBF43926) { failures++; }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t len = 0; len <= 64; len++) {
+            uint32_t crc = ~0u;
+            for (size_t i = 0; i < len; i++) {
+                crc ^= pattern[offset + i];
+                for (int j = 0; j < 8; j++) { crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1; }
+            }
+            if (cb_crc32(0, pattern + offset, len) != ~crc) { failures++; }
+            if (cb_crc32(cb_crc32(0, pattern + offset, len / 3), pattern + offset + len / 3, len - len / 3) != ~crc) { failures++; }
+        }
+    }
+    printf("Checksums, failures: %d\n", failures);
+
     ESP_ERROR_CHECK(wl_unmount(handle));
-    return 0;
+    return failures == 0 ? 0 : 1;
 }